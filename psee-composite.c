@@ -27,13 +27,14 @@
  * @asd: subdev asynchronous registration information
  * @entity: media entity, from the corresponding V4L2 subdev
  * @subdev: V4L2 subdev
- * @streaming: status of the V4L2 subdev if streaming or not
+ * @stream_count: number of streaming DMA engines fed by the subdev, protected
+ *		  by the composite device lock
  */
 struct psee_graph_entity {
 	struct v4l2_async_subdev asd; /* must be first */
 	struct media_entity *entity;
 	struct v4l2_subdev *subdev;
-	bool streaming;
+	unsigned int stream_count;
 };
 
 static inline struct psee_graph_entity *
@@ -78,6 +79,86 @@ psee_graph_find_entity_from_media(struct psee_composite_device *pdev,
 	return NULL;
 }
 
+/* The subdev entity feeding the first connected sink pad of an entity */
+static struct media_entity *psee_graph_upstream(struct media_entity *entity)
+{
+	struct media_pad *pad;
+	unsigned int i;
+
+	for (i = 0; i < entity->num_pads; i++) {
+		if (!(entity->pads[i].flags & MEDIA_PAD_FL_SINK))
+			continue;
+
+		pad = media_entity_remote_pad(&entity->pads[i]);
+		if (pad && is_media_entity_v4l2_subdev(pad->entity))
+			return pad->entity;
+	}
+
+	return NULL;
+}
+
+/**
+ * psee_graph_pipeline_start_stop - Start or stop the branch feeding a DMA
+ * @pdev: composite device
+ * @dma: DMA engine at the end of the branch
+ * @on: start (when true) or stop (when false) the branch
+ *
+ * Walk the subdevs upstream of the DMA engine, and start or stop them. A
+ * subdev may feed several DMA engines, when the pipeline splits: it is started
+ * with the first of them, and stopped with the last one. Nothing is done for
+ * an output DMA engine, which has no upstream subdev.
+ *
+ * Return: 0 if successful, or the return value of the failed video::s_stream
+ * operation otherwise. The subdevs started by the call are stopped on failure.
+ * Stopping never fails.
+ */
+int psee_graph_pipeline_start_stop(struct psee_composite_device *pdev,
+				   struct psee_dma *dma, bool on)
+{
+	struct media_entity *entity = &dma->video.entity;
+	struct media_entity *failed = NULL;
+	struct psee_graph_entity *ent;
+	int ret = 0;
+
+	mutex_lock(&pdev->lock);
+
+	while ((entity = psee_graph_upstream(entity))) {
+		ent = psee_graph_find_entity_from_media(pdev, entity);
+		if (ent == NULL)
+			break;
+
+		if (!on) {
+			if (ent->stream_count && --ent->stream_count == 0)
+				v4l2_subdev_call(ent->subdev, video, s_stream, 0);
+			continue;
+		}
+
+		if (ent->stream_count++)
+			continue;
+
+		ret = v4l2_subdev_call(ent->subdev, video, s_stream, 1);
+		if (ret < 0 && ret != -ENOIOCTLCMD) {
+			ent->stream_count--;
+			failed = entity;
+			break;
+		}
+		ret = 0;
+	}
+
+	/* Stop what was started downstream of the failed subdev */
+	if (failed) {
+		entity = &dma->video.entity;
+		while ((entity = psee_graph_upstream(entity)) != failed) {
+			ent = psee_graph_find_entity_from_media(pdev, entity);
+			if (--ent->stream_count == 0)
+				v4l2_subdev_call(ent->subdev, video, s_stream, 0);
+		}
+	}
+
+	mutex_unlock(&pdev->lock);
+	return ret;
+}
+
 static int psee_graph_build_one(struct psee_composite_device *pdev,
 				struct psee_graph_entity *entity)
 {
@@ -441,28 +522,84 @@ static int psee_graph_parse(struct psee_composite_device *pdev)
 	return ret;
 }
 
+/*
+ * Ports are inputs of the packetizer, feeding a capture node, unless their
+ * direction says they inject data in the pipeline.
+ */
+static int psee_graph_port_type(struct device_node *node, enum v4l2_buf_type *type)
+{
+	const char *direction;
+
+	*type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (of_property_read_string(node, "psee,direction", &direction))
+		return 0;
+
+	if (strcmp(direction, "output") == 0)
+		*type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	else if (strcmp(direction, "input") != 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+/* The number of capture ports with an index below @index */
+static unsigned int psee_graph_capture_rank(struct device_node *ports,
+					    unsigned int index)
+{
+	struct device_node *port;
+	enum v4l2_buf_type type;
+	unsigned int rank = 0;
+	u32 reg;
+
+	for_each_child_of_node(ports, port) {
+		if (of_property_read_u32(port, "reg", &reg) || reg >= index)
+			continue;
+		if (!psee_graph_port_type(port, &type) &&
+		    type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+			rank++;
+	}
+
+	return rank;
+}
+
 static int psee_graph_dma_init_one(struct psee_composite_device *pdev,
+				   struct device_node *ports,
 				   struct device_node *node)
 {
 	struct psee_dma *dma;
 	enum v4l2_buf_type type;
+	struct resource *io_space;
 	unsigned int index;
+	char name[16];
 	int ret;
 
 	of_property_read_u32(node, "reg", &index);
 
-	/* Originally there was a direction information on each port, to manage the DMA accordingly,
-	 * but now the binding states that there is exactly one port, acting as input.
-	 * Another may be added to inject data in the pipeline
-	 */
-	type = index == 0 ? V4L2_BUF_TYPE_VIDEO_CAPTURE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	if (psee_graph_port_type(node, &type) < 0) {
+		dev_err(pdev->dev, "invalid direction for %pOF\n", node);
+		return -EINVAL;
+	}
 
 	dma = devm_kzalloc(pdev->dev, sizeof(*dma), GFP_KERNEL);
 	if (dma == NULL)
 		return -ENOMEM;
 
-	ret = psee_dma_init(pdev, dma, type, index,
-		platform_get_resource(pdev->platform_dev, IORESOURCE_MEM, index));
+	/* Each capture port has its own packetizer registers, named after it if
+	 * the register banks are named, or taken in the order of the capture
+	 * port indexes otherwise. Output ports have no packetizer.
+	 */
+	if (of_find_property(pdev->dev->of_node, "reg-names", NULL)) {
+		snprintf(name, sizeof(name), "port%u", index);
+		io_space = platform_get_resource_byname(pdev->platform_dev,
+							IORESOURCE_MEM, name);
+	} else if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		io_space = platform_get_resource(pdev->platform_dev, IORESOURCE_MEM,
+						 psee_graph_capture_rank(ports, index));
+	} else {
+		io_space = NULL;
+	}
+
+	ret = psee_dma_init(pdev, dma, type, index, io_space);
 	if (ret < 0) {
 		dev_err(pdev->dev, "%pOF initialization failed\n", node);
 		return ret;
@@ -471,7 +608,8 @@ static int psee_graph_dma_init_one(struct psee_composite_device *pdev,
 	list_add_tail(&dma->list, &pdev->dmas);
 
 	pdev->v4l2_caps |= type == V4L2_BUF_TYPE_VIDEO_CAPTURE
-			 ? V4L2_CAP_VIDEO_CAPTURE : V4L2_CAP_VIDEO_OUTPUT;
+			 ? V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_META_CAPTURE
+			 : V4L2_CAP_VIDEO_OUTPUT;
 
 	return 0;
 }
@@ -489,7 +627,7 @@ static int psee_graph_dma_init(struct psee_composite_device *pdev)
 	}
 
 	for_each_child_of_node(ports, port) {
-		ret = psee_graph_dma_init_one(pdev, port);
+		ret = psee_graph_dma_init_one(pdev, ports, port);
 		if (ret < 0) {
 			of_node_put(port);
 			return ret;
@@ -605,6 +743,7 @@ static int psee_composite_probe(struct platform_device *platform_dev)
 	pdev->dev = &platform_dev->dev;
 	pdev->platform_dev = platform_dev;
 	INIT_LIST_HEAD(&pdev->dmas);
+	mutex_init(&pdev->lock);
 	v4l2_async_notifier_init(&pdev->notifier);
 
 	ret = psee_composite_v4l2_init(pdev);
@@ -633,6 +772,7 @@ static int psee_composite_probe(struct platform_device *platform_dev)
 
 error:
 	psee_composite_v4l2_cleanup(pdev);
+	mutex_destroy(&pdev->lock);
 	return ret;
 }
 
@@ -642,6 +782,7 @@ static int psee_composite_remove(struct platform_device *platform_dev)
 
 	psee_graph_cleanup(pdev);
 	psee_composite_v4l2_cleanup(pdev);
+	mutex_destroy(&pdev->lock);
 
 	return 0;
 }
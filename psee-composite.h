@@ -15,6 +15,8 @@
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
 
+struct psee_dma;
+
 /**
  * struct psee_composite_device - Prophesee Video IP device structure
  * @v4l2_dev: V4L2 device
@@ -23,7 +25,7 @@
  * @notifier: V4L2 asynchronous subdevs notifier
  * @dmas: list of DMA channels at the pipeline output and input
  * @v4l2_caps: V4L2 capabilities of the whole device (see VIDIOC_QUERYCAP)
- * @lock: This is to ensure all dma path entities acquire same pipeline object
+ * @lock: protects the stream counts of the graph entities
  */
 struct psee_composite_device {
 	struct v4l2_device v4l2_dev;
@@ -35,9 +37,11 @@ struct psee_composite_device {
 
 	struct list_head dmas;
 	u32 v4l2_caps;
+
+	struct mutex lock;
 };
 
 int psee_graph_pipeline_start_stop(struct psee_composite_device *pdev,
-				   struct psee_pipeline *pipe, bool on);
+				   struct psee_dma *dma, bool on);
 
 #endif /* PSEE_COMPOSITE_H */
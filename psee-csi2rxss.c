@@ -24,7 +24,9 @@
 #include <media/v4l2-subdev.h>
 
 /* define media-bus types in case it's not present in the kernel */
+#include "psee-csi2rxss.h"
 #include "psee-format.h"
+#include "psee-uapi.h"
 
 /*
  * Pad IDs. IP cores with multiple inputs or outputs should define
@@ -419,6 +421,58 @@ static void xcsi2rxss_log_counters(struct xcsi2rxss_state *state)
 	}
 }
 
+/* Sum of the counters of the events in mask */
+static u32 xcsi2rxss_event_count(struct xcsi2rxss_state *state, u32 mask)
+{
+	unsigned int i;
+	u32 count = 0;
+
+	for (i = 0; i < XCSI_NUM_EVENTS; i++)
+		if (xcsi2rxss_events[i].mask & mask)
+			count += READ_ONCE(state->events[i]);
+
+	return count;
+}
+
+/**
+ * xcsi2rxss_ioctl - Handles the private ioctls of the CSI-2 Receiver
+ * @sd: Pointer to V4L2 subdevice structure
+ * @cmd: ioctl command
+ * @arg: ioctl argument
+ *
+ * PSEE_CSI2_IOC_G_COUNTERS reads the event counters without taking the lock,
+ * as they are only updated by the interrupt handler, so that it can be called
+ * from the completion path of the DMA downstream. It must stay callable in
+ * atomic context: no sleeping, no mutex, no register access that may stall.
+ *
+ * Return: 0 on success, -ENOIOCTLCMD for an unknown command
+ */
+static long xcsi2rxss_ioctl(struct v4l2_subdev *sd, unsigned int cmd, void *arg)
+{
+	struct xcsi2rxss_state *xcsi2rxss = to_xcsi2rxssstate(sd);
+	struct psee_csi2_counters *counters = arg;
+
+	switch (cmd) {
+	case PSEE_CSI2_IOC_G_COUNTERS:
+		memset(counters, 0, sizeof(*counters));
+		counters->frames = xcsi2rxss_event_count(xcsi2rxss, XCSI_ISR_FR);
+		counters->crc_errors = xcsi2rxss_event_count(xcsi2rxss, XCSI_ISR_CRCERR);
+		counters->ecc_1bit_errors =
+			xcsi2rxss_event_count(xcsi2rxss, XCSI_ISR_ECC1BERR);
+		counters->ecc_2bit_errors =
+			xcsi2rxss_event_count(xcsi2rxss, XCSI_ISR_ECC2BERR);
+		counters->sot_errors = xcsi2rxss_event_count(xcsi2rxss,
+				XCSI_ISR_SOTERR | XCSI_ISR_SOTSYNCERR);
+		counters->word_count_errors =
+			xcsi2rxss_event_count(xcsi2rxss, XCSI_ISR_WCC);
+		counters->line_buffer_full =
+			xcsi2rxss_event_count(xcsi2rxss, XCSI_ISR_SLBF);
+		return 0;
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
+
 /**
  * xcsi2rxss_log_status - Logs the status of the CSI-2 Receiver
  * @sd: Pointer to V4L2 subdevice structure
@@ -940,6 +994,7 @@ static const struct media_entity_operations xcsi2rxss_media_ops = {
 
 static const struct v4l2_subdev_core_ops xcsi2rxss_core_ops = {
 	.log_status = xcsi2rxss_log_status,
+	.ioctl = xcsi2rxss_ioctl,
 #ifdef CONFIG_VIDEO_ADV_DEBUG
 	.g_register = g_register,
 	.s_register = s_register,
@@ -964,6 +1019,21 @@ static const struct v4l2_subdev_ops xcsi2rxss_ops = {
 	.pad = &xcsi2rxss_pad_ops
 };
 
+/**
+ * psee_csi2rxss_is - Tell whether a subdev is a CSI-2 Receiver of this driver
+ * @sd: Pointer to V4L2 subdevice structure
+ *
+ * Only this driver implements PSEE_CSI2_IOC_G_COUNTERS, other drivers may give
+ * the same ioctl number another meaning.
+ *
+ * Return: true if @sd is handled by this driver
+ */
+bool psee_csi2rxss_is(struct v4l2_subdev *sd)
+{
+	return sd->ops == &xcsi2rxss_ops;
+}
+EXPORT_SYMBOL_GPL(psee_csi2rxss_is);
+
 static int xcsi2rxss_parse_of(struct xcsi2rxss_state *xcsi2rxss)
 {
 	struct device *dev = xcsi2rxss->dev;
@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Xilinx MIPI CSI-2 Rx Subsystem, interface to the Prophesee Video DMA
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#ifndef PSEE_CSI2RXSS_H
+#define PSEE_CSI2RXSS_H
+
+#include <linux/types.h>
+
+struct v4l2_subdev;
+
+bool psee_csi2rxss_is(struct v4l2_subdev *sd);
+
+#endif /* PSEE_CSI2RXSS_H */
@@ -0,0 +1,335 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * KUnit tests for the Prophesee Video DMA adaptive packetization
+ *
+ * The controller is fed with traces of buffer completions, as the payload and
+ * the interval since the previous buffer, and the resulting timeout and packet
+ * length are checked after each buffer. A mocked DMA channel also replays
+ * recorded payloads through the residue of its transfers, as the driver sees
+ * them, the controller reprogramming the packet length of the mock.
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#include <kunit/test.h>
+#include <linux/dmaengine.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/scatterlist.h>
+
+#include "psee-dma.h"
+
+#define TARGET_US	1000
+#define MIN_TIMEOUT_US	10
+#define MAX_LENGTH	(1 << 20)
+
+/**
+ * struct psee_dma_adapt_step - A buffer completion and its expected outcome
+ * @interval_us: time since the previous completion
+ * @payload: bytes transferred in the buffer
+ * @changed: the packetizer shall be reprogrammed
+ * @timeout_us: expected timeout after the buffer
+ * @packet_length: expected packet length after the buffer
+ */
+struct psee_dma_adapt_step {
+	u32 interval_us;
+	u32 payload;
+	bool changed;
+	u32 timeout_us;
+	u32 packet_length;
+};
+
+static void psee_dma_adapt_replay(struct kunit *test,
+				  const struct psee_dma_adapt_step *steps,
+				  unsigned int count)
+{
+	struct psee_dma_adapt adapt;
+	u64 now_ns = NSEC_PER_MSEC;
+	unsigned int i;
+
+	psee_dma_adapt_reset(&adapt, TARGET_US, MIN_TIMEOUT_US, MAX_LENGTH);
+	KUNIT_EXPECT_EQ(test, adapt.timeout_us, (u32)TARGET_US);
+	KUNIT_EXPECT_EQ(test, adapt.packet_length, (u32)MAX_LENGTH);
+
+	/* The first buffer only gives the time origin */
+	KUNIT_EXPECT_FALSE(test, psee_dma_adapt_update(&adapt, 0, now_ns));
+
+	for (i = 0; i < count; i++) {
+		now_ns += (u64)steps[i].interval_us * NSEC_PER_USEC;
+		KUNIT_EXPECT_EQ_MSG(test, psee_dma_adapt_update(&adapt, steps[i].payload, now_ns),
+				    steps[i].changed, "step %u", i);
+		KUNIT_EXPECT_EQ_MSG(test, adapt.timeout_us, steps[i].timeout_us,
+				    "step %u", i);
+		KUNIT_EXPECT_EQ_MSG(test, adapt.packet_length, steps[i].packet_length,
+				    "step %u", i);
+	}
+}
+
+/* A quiet scene, a burst of activity, then quiet again */
+static void psee_dma_adapt_test_trace(struct kunit *test)
+{
+	static const struct psee_dma_adapt_step steps[] = {
+		/* Late and almost empty: shorter timeout, halved packets */
+		{ 1500, 65536, true, 875, 524288 },
+		/* Late: a quarter of the gap is closed */
+		{ 1300, 200000, true, 800, 524288 },
+		/* Full, but not fast enough to grow the packets */
+		{ 900, 524288, false, 800, 524288 },
+		/* Full and fast: doubled packets */
+		{ 400, 524288, true, 800, 1048576 },
+		/* No larger than the buffers */
+		{ 300, 1048576, false, 800, 1048576 },
+		/* Stalled: the timeout stops at its minimum */
+		{ 100000, 0, true, MIN_TIMEOUT_US, 524288 },
+		/* Early: the timeout grows back */
+		{ 900, 100, true, 35, 262144 },
+	};
+
+	psee_dma_adapt_replay(test, steps, ARRAY_SIZE(steps));
+}
+
+/* Quiet buffers keep halving the packets, down to a page */
+static void psee_dma_adapt_test_min_length(struct kunit *test)
+{
+	struct psee_dma_adapt adapt;
+	u64 now_ns = NSEC_PER_MSEC;
+	unsigned int i;
+
+	psee_dma_adapt_reset(&adapt, TARGET_US, MIN_TIMEOUT_US, MAX_LENGTH);
+	psee_dma_adapt_update(&adapt, 0, now_ns);
+
+	for (i = 0; i < 32; i++) {
+		now_ns += TARGET_US * NSEC_PER_USEC;
+		psee_dma_adapt_update(&adapt, 0, now_ns);
+	}
+
+	KUNIT_EXPECT_EQ(test, adapt.packet_length, (u32)PSEE_DMA_MIN_TRANSFER_SIZE);
+	KUNIT_EXPECT_EQ(test, adapt.timeout_us, (u32)TARGET_US);
+
+	/* Settled: nothing to reprogram */
+	now_ns += TARGET_US * NSEC_PER_USEC;
+	KUNIT_EXPECT_FALSE(test, psee_dma_adapt_update(&adapt, 0, now_ns));
+}
+
+/* A completion time going backwards restarts from it, without any change */
+static void psee_dma_adapt_test_time_backwards(struct kunit *test)
+{
+	struct psee_dma_adapt adapt;
+
+	psee_dma_adapt_reset(&adapt, TARGET_US, MIN_TIMEOUT_US, MAX_LENGTH);
+	psee_dma_adapt_update(&adapt, 0, 10 * NSEC_PER_MSEC);
+
+	KUNIT_EXPECT_FALSE(test, psee_dma_adapt_update(&adapt, 0, 5 * NSEC_PER_MSEC));
+	KUNIT_EXPECT_EQ(test, adapt.last_ns, (u64)(5 * NSEC_PER_MSEC));
+	KUNIT_EXPECT_EQ(test, adapt.timeout_us, (u32)TARGET_US);
+	KUNIT_EXPECT_EQ(test, adapt.packet_length, (u32)MAX_LENGTH);
+}
+
+/* The minimum timeout can't exceed the target */
+static void psee_dma_adapt_test_reset(struct kunit *test)
+{
+	struct psee_dma_adapt adapt;
+
+	psee_dma_adapt_reset(&adapt, 100, 500, MAX_LENGTH);
+	KUNIT_EXPECT_EQ(test, adapt.min_timeout_us, 100U);
+	KUNIT_EXPECT_EQ(test, adapt.last_ns, 0ULL);
+}
+
+/**
+ * struct psee_dma_mock_record - A recorded packet
+ * @interval_us: time since the previous packet completion
+ * @bytes: data received for the packet, cut to the packet length
+ */
+struct psee_dma_mock_record {
+	u32 interval_us;
+	u32 bytes;
+};
+
+/**
+ * struct psee_dma_mock - DMA channel replaying recorded packets
+ * @device: DMA device of the channel, only its callbacks are set
+ * @chan: the channel given to the dmaengine API
+ * @desc: the transfer, one at a time
+ * @test: test running the channel
+ * @records: packets to replay
+ * @count: number of packets in @records
+ * @next: index of the next packet to replay
+ * @length: length of the prepared transfer
+ * @submitted: the transfer is submitted, and not completed yet
+ * @packet_length: packet length programmed by the controller
+ * @now_ns: completion time of the last packet
+ * @adapt: controller under test
+ * @changes: number of times the controller reprogrammed the mock
+ */
+struct psee_dma_mock {
+	struct dma_device device;
+	struct dma_chan chan;
+	struct dma_async_tx_descriptor desc;
+	struct kunit *test;
+	const struct psee_dma_mock_record *records;
+	unsigned int count;
+	unsigned int next;
+	u32 length;
+	bool submitted;
+	u32 packet_length;
+	u64 now_ns;
+	struct psee_dma_adapt adapt;
+	unsigned int changes;
+};
+
+static dma_cookie_t psee_dma_mock_submit(struct dma_async_tx_descriptor *desc)
+{
+	struct psee_dma_mock *mock = container_of(desc, struct psee_dma_mock, desc);
+
+	mock->submitted = true;
+	return 1;
+}
+
+static struct dma_async_tx_descriptor *
+psee_dma_mock_prep_slave_sg(struct dma_chan *chan, struct scatterlist *sgl,
+			    unsigned int sg_len, enum dma_transfer_direction direction,
+			    unsigned long flags, void *context)
+{
+	struct psee_dma_mock *mock = container_of(chan, struct psee_dma_mock, chan);
+
+	KUNIT_EXPECT_EQ(mock->test, sg_len, 1U);
+	KUNIT_EXPECT_EQ(mock->test, direction, DMA_DEV_TO_MEM);
+	KUNIT_EXPECT_FALSE(mock->test, mock->submitted);
+
+	memset(&mock->desc, 0, sizeof(mock->desc));
+	mock->desc.chan = chan;
+	mock->desc.tx_submit = psee_dma_mock_submit;
+	mock->length = sg_dma_len(sgl);
+
+	return &mock->desc;
+}
+
+/* Complete the submitted transfer with the next recorded packet */
+static void psee_dma_mock_issue_pending(struct dma_chan *chan)
+{
+	struct psee_dma_mock *mock = container_of(chan, struct psee_dma_mock, chan);
+	const struct psee_dma_mock_record *record;
+	struct dmaengine_result result = {
+		.result = DMA_TRANS_NOERROR,
+	};
+	u32 payload;
+
+	if (!mock->submitted || mock->next == mock->count)
+		return;
+
+	record = &mock->records[mock->next++];
+	mock->now_ns += (u64)record->interval_us * NSEC_PER_USEC;
+	payload = min3(record->bytes, mock->packet_length, mock->length);
+	result.residue = mock->length - payload;
+	mock->submitted = false;
+	mock->desc.callback_result(mock->desc.callback_param, &result);
+}
+
+/* As the driver completion path: the payload is what the residue leaves */
+static void psee_dma_mock_complete(void *param, const struct dmaengine_result *result)
+{
+	struct psee_dma_mock *mock = param;
+	u32 payload = mock->length - result->residue;
+
+	if (psee_dma_adapt_update(&mock->adapt, payload, mock->now_ns)) {
+		mock->packet_length = mock->adapt.packet_length;
+		mock->changes++;
+	}
+}
+
+/* Allocated, the DMA device is too large for the stack */
+static struct psee_dma_mock *psee_dma_mock_create(struct kunit *test)
+{
+	struct psee_dma_mock *mock;
+
+	mock = kunit_kzalloc(test, sizeof(*mock), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, mock);
+
+	mock->device.device_prep_slave_sg = psee_dma_mock_prep_slave_sg;
+	mock->device.device_issue_pending = psee_dma_mock_issue_pending;
+	mock->chan.device = &mock->device;
+	mock->test = test;
+	mock->now_ns = NSEC_PER_MSEC;
+
+	psee_dma_adapt_reset(&mock->adapt, TARGET_US, MIN_TIMEOUT_US, MAX_LENGTH);
+	mock->packet_length = mock->adapt.packet_length;
+
+	return mock;
+}
+
+/* Capture the recorded packets, a buffer at a time */
+static void psee_dma_mock_replay(struct psee_dma_mock *mock,
+				 const struct psee_dma_mock_record *records,
+				 unsigned int count)
+{
+	struct dma_async_tx_descriptor *desc;
+
+	mock->records = records;
+	mock->count = count;
+	mock->next = 0;
+
+	while (mock->next < count) {
+		desc = dmaengine_prep_slave_single(&mock->chan, 0, MAX_LENGTH,
+						   DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(mock->test, desc);
+		desc->callback_result = psee_dma_mock_complete;
+		desc->callback_param = mock;
+		dmaengine_submit(desc);
+		dma_async_issue_pending(&mock->chan);
+	}
+}
+
+/* A quiet scene, a burst cut by the packet length, then a busier scene */
+static void psee_dma_adapt_test_mock_channel(struct kunit *test)
+{
+	static const struct psee_dma_mock_record quiet[] = {
+		{ 1200, 3000 }, { 1200, 3000 }, { 1200, 3000 },
+		{ 1200, 3000 }, { 1200, 3000 }, { 1200, 3000 },
+	};
+	static const struct psee_dma_mock_record burst[] = {
+		{ 250, MAX_LENGTH }, { 250, MAX_LENGTH }, { 250, MAX_LENGTH },
+		{ 250, MAX_LENGTH }, { 250, MAX_LENGTH }, { 250, MAX_LENGTH },
+		{ 250, MAX_LENGTH }, { 250, MAX_LENGTH },
+	};
+	static const struct psee_dma_mock_record busy[] = {
+		{ 1100, 200000 }, { 1100, 200000 }, { 1100, 200000 },
+	};
+	struct psee_dma_mock *mock = psee_dma_mock_create(test);
+
+	/* Late and almost empty: the first packet only gives the time origin */
+	psee_dma_mock_replay(mock, quiet, ARRAY_SIZE(quiet));
+	KUNIT_EXPECT_EQ(test, mock->changes, 5U);
+	KUNIT_EXPECT_EQ(test, mock->adapt.timeout_us, 750U);
+	KUNIT_EXPECT_EQ(test, mock->packet_length, 32768U);
+
+	/* Full and fast: the packets grow back to the buffers, then stay */
+	psee_dma_mock_replay(mock, burst, ARRAY_SIZE(burst));
+	KUNIT_EXPECT_EQ(test, mock->changes, 10U);
+	KUNIT_EXPECT_EQ(test, mock->adapt.timeout_us, 750U);
+	KUNIT_EXPECT_EQ(test, mock->packet_length, (u32)MAX_LENGTH);
+
+	/* Late and under a quarter full: halved once, then the timeout only */
+	psee_dma_mock_replay(mock, busy, ARRAY_SIZE(busy));
+	KUNIT_EXPECT_EQ(test, mock->changes, 13U);
+	KUNIT_EXPECT_EQ(test, mock->adapt.timeout_us, 675U);
+	KUNIT_EXPECT_EQ(test, mock->packet_length, 524288U);
+}
+
+static struct kunit_case psee_dma_adapt_test_cases[] = {
+	KUNIT_CASE(psee_dma_adapt_test_trace),
+	KUNIT_CASE(psee_dma_adapt_test_min_length),
+	KUNIT_CASE(psee_dma_adapt_test_time_backwards),
+	KUNIT_CASE(psee_dma_adapt_test_reset),
+	KUNIT_CASE(psee_dma_adapt_test_mock_channel),
+	{}
+};
+
+static struct kunit_suite psee_dma_adapt_test_suite = {
+	.name = "psee-dma-adapt",
+	.test_cases = psee_dma_adapt_test_cases,
+};
+
+kunit_test_suite(psee_dma_adapt_test_suite);
+
+MODULE_DESCRIPTION("Prophesee Video DMA adaptive packetization tests");
+MODULE_LICENSE("GPL v2");
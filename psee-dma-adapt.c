@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Prophesee Video DMA adaptive packetization
+ *
+ * With a latency target set, the driver owns the transfer timeout and the
+ * packet length, and retunes them after each buffer completion:
+ * - buffers closed before being full (timeout) should complete within the
+ *   target. Their completion interval is the timeout plus the DMA and interrupt
+ *   latency, and is used to correct the timeout.
+ * - buffers should be neither too full nor too empty. Full buffers completing
+ *   faster than half the target mean a lot of completions for nothing, and the
+ *   packet length is doubled (up to the buffer size). Timeout buffers less than
+ *   a quarter full mean a quiet scene, and the packet length is halved, so that
+ *   a burst of activity closes its first buffers on size, well within the
+ *   target, instead of waiting for the timeout.
+ *
+ * This part only depends on the completed payloads and their timing, and can
+ * be exercised by any DMA engine (or mock) reporting a residue, see
+ * psee-dma-adapt-test.c.
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+
+#include "psee-dma.h"
+
+void psee_dma_adapt_reset(struct psee_dma_adapt *adapt, u32 target_us,
+			  u32 min_timeout_us, u32 max_length)
+{
+	adapt->target_us = target_us;
+	adapt->min_timeout_us = min(min_timeout_us, target_us);
+	adapt->max_length = max_length;
+	adapt->timeout_us = target_us;
+	adapt->packet_length = max_length;
+	adapt->last_ns = 0;
+}
+
+/**
+ * psee_dma_adapt_update - Feed a completed buffer to the adaptive packetization
+ * @adapt: the controller state
+ * @payload: bytes transferred in the buffer
+ * @now_ns: completion time of the buffer
+ *
+ * Return: true if the timeout or the packet length changed, and the packetizer
+ * shall be reprogrammed.
+ */
+bool psee_dma_adapt_update(struct psee_dma_adapt *adapt, u32 payload, u64 now_ns)
+{
+	u32 timeout_us = adapt->timeout_us;
+	u32 length = adapt->packet_length;
+	u64 interval_us;
+	s64 error;
+
+	if (!adapt->last_ns || now_ns <= adapt->last_ns) {
+		adapt->last_ns = now_ns;
+		return false;
+	}
+	interval_us = div_u64(now_ns - adapt->last_ns, NSEC_PER_USEC);
+	adapt->last_ns = now_ns;
+
+	if (payload >= length) {
+		if (interval_us < adapt->target_us / 2)
+			length = min(length * 2, adapt->max_length);
+	} else {
+		/* Close a quarter of the gap to the target at each buffer */
+		error = (s64)adapt->target_us - (s64)interval_us;
+		timeout_us = clamp_t(s64, (s64)timeout_us + error / 4,
+				     adapt->min_timeout_us, adapt->target_us);
+
+		if (payload < length / 4)
+			length = max_t(u32, length / 2, PSEE_DMA_MIN_TRANSFER_SIZE);
+	}
+
+	if (timeout_us == adapt->timeout_us && length == adapt->packet_length)
+		return false;
+
+	adapt->timeout_us = timeout_us;
+	adapt->packet_length = length;
+	return true;
+}
+
+#if IS_ENABLED(CONFIG_KUNIT)
+/* For the KUnit tests, built as their own module */
+EXPORT_SYMBOL_GPL(psee_dma_adapt_reset);
+EXPORT_SYMBOL_GPL(psee_dma_adapt_update);
+#endif
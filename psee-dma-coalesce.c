@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Prophesee Video DMA completion coalescing
+ *
+ * With small packets, each capture buffer costs a completion and a wakeup of
+ * the application. Coalescing holds the completed buffers until a batch of
+ * them is ready, or until the oldest one waited long enough, and gives them
+ * back-to-back to their users, who then wake once per batch. Buffers keep the
+ * sequence number of their completion. The batch waiting when the stream stops
+ * is lost, as videobuf2 discards the buffers done from stop_streaming: turning
+ * coalescing off first delivers it.
+ *
+ * In the automatic mode, batches are only made while the buffer rate fills
+ * them in time, so that a slow stream keeps its latency.
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+#include "psee-dma.h"
+#include "psee-uapi.h"
+
+/* The completion interval is averaged over about 8 buffers */
+#define PSEE_DMA_COALESCE_AVG_SHIFT	3
+
+/*
+ * Give the waiting buffers to their users, in completion order, as failed if
+ * @discard is set. Must be called with the coalescing lock held, so that
+ * batches are not reordered.
+ */
+static void psee_dma_coalesce_flush(struct psee_dma *dma, bool discard)
+{
+	struct psee_dma_coalesce *co = &dma->coalesce;
+	struct psee_dma_buffer *buf, *nbuf;
+
+	if (co->pending > 1) {
+		co->batches++;
+		co->batched += co->pending;
+	}
+	co->pending = 0;
+
+	list_for_each_entry_safe(buf, nbuf, &co->bufs, queue) {
+		list_del(&buf->queue);
+		psee_dma_buffer_deliver(dma, buf, discard || buf->failed);
+	}
+}
+
+/*
+ * Whether a buffer completed at @now waits for a batch. Must be called with the
+ * coalescing lock held.
+ */
+static bool psee_dma_coalesce_wanted(struct psee_dma *dma, u64 now)
+{
+	struct psee_dma_coalesce *co = &dma->coalesce;
+	u64 interval = min_t(u64, now - co->last_ns, NSEC_PER_SEC);
+	u64 fill_ns, delay_ns = (u64)co->delay_us * NSEC_PER_USEC;
+
+	co->last_ns = now;
+	co->interval_ns += (interval >> PSEE_DMA_COALESCE_AVG_SHIFT) -
+			   (co->interval_ns >> PSEE_DMA_COALESCE_AVG_SHIFT);
+
+	switch (co->mode) {
+	case PSEE_DMA_COALESCE_ON:
+		return true;
+	case PSEE_DMA_COALESCE_AUTO:
+		/* Some hysteresis, for a rate close to the threshold */
+		fill_ns = co->interval_ns * co->buffers;
+		if (fill_ns <= delay_ns)
+			co->batching = true;
+		else if (fill_ns > 2 * delay_ns)
+			co->batching = false;
+		return co->batching;
+	default:
+		return false;
+	}
+}
+
+/**
+ * psee_dma_coalesce_complete - Give a completed buffer to its batch
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer
+ * @failed: the transfer failed
+ * @now: completion time of the buffer
+ *
+ * Called from the capture completion path instead of delivering the buffer.
+ */
+void psee_dma_coalesce_complete(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				bool failed, u64 now)
+{
+	struct psee_dma_coalesce *co = &dma->coalesce;
+
+	spin_lock(&co->lock);
+	buf->failed = failed;
+	list_add_tail(&buf->queue, &co->bufs);
+	co->pending++;
+
+	if (!psee_dma_coalesce_wanted(dma, now) || co->pending >= co->buffers) {
+		/* The timer may run meanwhile, it then finds nothing to flush */
+		hrtimer_try_to_cancel(&co->timer);
+		psee_dma_coalesce_flush(dma, false);
+	} else if (co->pending == 1) {
+		hrtimer_start(&co->timer, us_to_ktime(co->delay_us), HRTIMER_MODE_REL_SOFT);
+	}
+	spin_unlock(&co->lock);
+}
+
+static enum hrtimer_restart psee_dma_coalesce_timeout(struct hrtimer *timer)
+{
+	struct psee_dma *dma = container_of(timer, struct psee_dma, coalesce.timer);
+
+	spin_lock(&dma->coalesce.lock);
+	psee_dma_coalesce_flush(dma, false);
+	spin_unlock(&dma->coalesce.lock);
+
+	return HRTIMER_NORESTART;
+}
+
+void psee_dma_coalesce_start(struct psee_dma *dma)
+{
+	struct psee_dma_coalesce *co = &dma->coalesce;
+
+	spin_lock_irq(&co->lock);
+	co->last_ns = ktime_get_ns();
+	co->interval_ns = 0;
+	co->batching = false;
+	co->batches = 0;
+	co->batched = 0;
+	spin_unlock_irq(&co->lock);
+}
+
+/* Switch the mode, turning coalescing off delivers the waiting batch at once */
+void psee_dma_coalesce_set_mode(struct psee_dma *dma, u32 mode)
+{
+	struct psee_dma_coalesce *co = &dma->coalesce;
+
+	spin_lock_irq(&co->lock);
+	co->mode = mode;
+	if (mode == PSEE_DMA_COALESCE_OFF) {
+		hrtimer_try_to_cancel(&co->timer);
+		psee_dma_coalesce_flush(dma, false);
+	}
+	spin_unlock_irq(&co->lock);
+}
+
+/* Give back the last batch as failed, once the DMA stopped completing buffers */
+void psee_dma_coalesce_stop(struct psee_dma *dma)
+{
+	struct psee_dma_coalesce *co = &dma->coalesce;
+
+	hrtimer_cancel(&co->timer);
+
+	spin_lock_irq(&co->lock);
+	psee_dma_coalesce_flush(dma, true);
+	spin_unlock_irq(&co->lock);
+}
+
+void psee_dma_coalesce_init(struct psee_dma *dma)
+{
+	struct psee_dma_coalesce *co = &dma->coalesce;
+
+	spin_lock_init(&co->lock);
+	INIT_LIST_HEAD(&co->bufs);
+	hrtimer_init(&co->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	co->timer.function = psee_dma_coalesce_timeout;
+	co->mode = PSEE_DMA_COALESCE_OFF;
+	co->buffers = PSEE_DMA_COALESCE_DEF_BUFFERS;
+	co->delay_us = PSEE_DMA_COALESCE_DEF_DELAY_US;
+}
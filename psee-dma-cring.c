@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Prophesee Video DMA completion ring
+ *
+ * With the completion ring enabled, capture buffers stay with the driver from
+ * their first VIDIOC_QBUF to the stream stop. Completed buffers are posted in
+ * a ring mapped by the userspace, which gives them back through a submission
+ * ring in the same page. Submissions are consumed on each completion, and on
+ * PSEE_DMA_IOC_CRING_KICK, so that a busy stream needs no ioctl at all.
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#include <linux/build_bug.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include <media/v4l2-event.h>
+#include <media/v4l2-fh.h>
+#include <media/videobuf2-v4l2.h>
+
+#include "psee-dma.h"
+#include "psee-uapi.h"
+
+/*
+ * Give back to the DMA the buffers the userspace submitted. Must be called
+ * with the ring lock held. The userspace counter is not trusted: a pass
+ * consumes at most a ring of entries, and only buffers held by the userspace
+ * are accepted.
+ */
+static void psee_dma_cring_drain(struct psee_dma *dma)
+{
+	struct psee_dma_cring_state *cring = &dma->cring;
+	struct psee_dma_cring *ring = cring->ring;
+	struct psee_dma_buffer *buf;
+	unsigned int n;
+	u32 head, index;
+
+	/* Once the DMA is stopping, the submitted buffers wait for the stop */
+	if (READ_ONCE(dma->stopping))
+		return;
+
+	head = smp_load_acquire(&ring->sub_head);
+	for (n = 0; cring->sub_tail != head && n < PSEE_DMA_CRING_ENTRIES; n++) {
+		index = READ_ONCE(ring->sub[cring->sub_tail++ % PSEE_DMA_CRING_ENTRIES]);
+		if (index >= dma->queue.num_buffers) {
+			cring->rejected++;
+			continue;
+		}
+
+		buf = to_psee_dma_buffer(to_vb2_v4l2_buffer(dma->queue.bufs[index]));
+		if (!buf->cring_user) {
+			cring->rejected++;
+			continue;
+		}
+
+		buf->cring_user = false;
+		psee_dma_submit(dma, buf);
+	}
+
+	/* Let the userspace reuse the entries */
+	smp_store_release(&ring->sub_tail, cring->sub_tail);
+	WRITE_ONCE(ring->rejected, cring->rejected);
+}
+
+/**
+ * psee_dma_cring_complete - Post a completed buffer in the completion ring
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer
+ * @failed: the transfer failed
+ *
+ * Called from the capture completion path instead of vb2_buffer_done(). A
+ * buffer is posted once until submitted back, so the ring never overflows.
+ */
+void psee_dma_cring_complete(struct psee_dma *dma, struct psee_dma_buffer *buf, bool failed)
+{
+	struct psee_dma_cring_state *cring = &dma->cring;
+	struct psee_dma_cring *ring = cring->ring;
+	struct psee_dma_cring_entry *entry;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cring->lock, flags);
+	entry = &ring->comp[cring->comp_head % PSEE_DMA_CRING_ENTRIES];
+	entry->index = buf->buf.vb2_buf.index;
+	entry->sequence = buf->buf.sequence;
+	entry->bytesused = vb2_get_plane_payload(&buf->buf.vb2_buf, 0);
+	entry->flags = buf->buf.flags & (PSEE_BUF_FLAG_CLOSE_MASK | PSEE_BUF_FLAG_GAP);
+	if (failed)
+		entry->flags |= V4L2_BUF_FLAG_ERROR;
+	entry->timestamp = buf->buf.vb2_buf.timestamp;
+	buf->cring_user = true;
+	/* Publish the entry before the counter */
+	smp_store_release(&ring->comp_head, ++cring->comp_head);
+
+	/* The DMA gets the buffers given back meanwhile */
+	psee_dma_cring_drain(dma);
+	spin_unlock_irqrestore(&cring->lock, flags);
+
+	wake_up_interruptible(&cring->wait);
+}
+
+/* Consume the submissions without waiting for the next completion */
+int psee_dma_cring_kick(struct psee_dma *dma)
+{
+	struct psee_dma_cring_state *cring = &dma->cring;
+	unsigned long flags;
+
+	if (!cring->enabled)
+		return -ENOTTY;
+	if (!vb2_is_streaming(&dma->queue))
+		return -EPIPE;
+
+	spin_lock_irqsave(&cring->lock, flags);
+	psee_dma_cring_drain(dma);
+	spin_unlock_irqrestore(&cring->lock, flags);
+
+	return 0;
+}
+
+/* Empty the ring, before the buffers are first queued to the DMA */
+void psee_dma_cring_start(struct psee_dma *dma)
+{
+	struct psee_dma_cring_state *cring = &dma->cring;
+
+	if (!cring->enabled)
+		return;
+
+	spin_lock_irq(&cring->lock);
+	memset(cring->ring, 0, sizeof(*cring->ring));
+	cring->comp_head = 0;
+	cring->sub_tail = 0;
+	cring->rejected = 0;
+	spin_unlock_irq(&cring->lock);
+}
+
+/* Give back to videobuf2 the buffers held by the userspace */
+void psee_dma_cring_stop(struct psee_dma *dma)
+{
+	struct psee_dma_cring_state *cring = &dma->cring;
+	struct psee_dma_buffer *buf;
+	unsigned int i;
+
+	if (!cring->enabled)
+		return;
+
+	spin_lock_irq(&cring->lock);
+	for (i = 0; i < dma->queue.num_buffers; i++) {
+		buf = to_psee_dma_buffer(to_vb2_v4l2_buffer(dma->queue.bufs[i]));
+		if (!buf->cring_user)
+			continue;
+		buf->cring_user = false;
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+	}
+	spin_unlock_irq(&cring->lock);
+
+	wake_up_interruptible(&cring->wait);
+}
+
+/*
+ * Switch the completion ring mode, while no buffer is allocated. The ring is
+ * allocated on first use, and kept until the device goes away, as it may stay
+ * mapped.
+ */
+int psee_dma_cring_enable(struct psee_dma *dma, bool enable)
+{
+	struct psee_dma_cring_state *cring = &dma->cring;
+	bool readers;
+
+	if (enable) {
+		/* Fan-out readers need the buffers to go through videobuf2 */
+		spin_lock_irq(&dma->fanout.lock);
+		readers = !list_empty(&dma->fanout.readers);
+		spin_unlock_irq(&dma->fanout.lock);
+		if (readers)
+			return -EBUSY;
+	}
+
+	if (enable && !cring->ring) {
+		cring->ring = vmalloc_user(PAGE_ALIGN(sizeof(*cring->ring)));
+		if (!cring->ring)
+			return -ENOMEM;
+	}
+
+	cring->enabled = enable;
+	return 0;
+}
+
+int psee_dma_cring_mmap(struct psee_dma *dma, struct vm_area_struct *vma)
+{
+	if (!dma->cring.ring)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, dma->cring.ring, 0);
+}
+
+/* Poll of the queue owner, on the completion ring rather than on videobuf2 */
+__poll_t psee_dma_cring_poll(struct psee_dma *dma, struct v4l2_fh *fh,
+			     struct file *file, poll_table *wait)
+{
+	struct psee_dma_cring_state *cring = &dma->cring;
+	__poll_t req_events = poll_requested_events(wait);
+	__poll_t res = 0;
+
+	if (v4l2_event_pending(fh))
+		res = EPOLLPRI;
+	else if (req_events & EPOLLPRI)
+		poll_wait(file, &fh->wait, wait);
+
+	if (!(req_events & (EPOLLIN | EPOLLRDNORM)))
+		return res;
+
+	poll_wait(file, &cring->wait, wait);
+
+	if (!vb2_is_streaming(&dma->queue))
+		return res | EPOLLERR;
+
+	if (READ_ONCE(cring->comp_head) != READ_ONCE(cring->ring->comp_tail))
+		res |= EPOLLIN | EPOLLRDNORM;
+
+	return res;
+}
+
+void psee_dma_cring_init(struct psee_dma *dma)
+{
+	/* A ring holds all the buffers, so that it never overflows */
+	BUILD_BUG_ON(VB2_MAX_FRAME > PSEE_DMA_CRING_ENTRIES);
+
+	spin_lock_init(&dma->cring.lock);
+	init_waitqueue_head(&dma->cring.wait);
+}
+
+void psee_dma_cring_cleanup(struct psee_dma *dma)
+{
+	vfree(dma->cring.ring);
+	dma->cring.ring = NULL;
+}
@@ -0,0 +1,390 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Prophesee Video DMA capture fan-out
+ *
+ * Readers beside the owner of a capture queue get each filled buffer too,
+ * through private ioctls on the capture node, and map the buffers through the
+ * node. A buffer queued back by the owner only goes to the DMA once all the
+ * readers released it. A lagging reader either holds the stream back, or
+ * skips to the newest buffer.
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#include <linux/bitmap.h>
+#include <linux/fcntl.h>
+#include <linux/list.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+
+#include <media/v4l2-event.h>
+#include <media/v4l2-fh.h>
+#include <media/videobuf2-v4l2.h>
+
+#include "psee-dma.h"
+#include "psee-uapi.h"
+
+static struct psee_dma_buffer *psee_dma_fanout_buffer(struct psee_dma *dma, u32 index)
+{
+	return to_psee_dma_buffer(to_vb2_v4l2_buffer(dma->queue.bufs[index]));
+}
+
+/*
+ * Drop a reference of a reader on a buffer. Must be called with the fan-out
+ * lock held. A parked buffer moves to @release once the last reader let it
+ * go, the caller submits it once the lock is released.
+ */
+static void psee_dma_fanout_put(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				struct list_head *release)
+{
+	if (WARN_ON(!buf->readers))
+		return;
+	if (--buf->readers || !buf->parked)
+		return;
+
+	buf->parked = false;
+	list_move_tail(&buf->queue, release);
+}
+
+static void psee_dma_fanout_submit(struct psee_dma *dma, struct list_head *release)
+{
+	struct psee_dma_buffer *buf, *nbuf;
+
+	list_for_each_entry_safe(buf, nbuf, release, queue) {
+		list_del(&buf->queue);
+		psee_dma_submit(dma, buf);
+	}
+}
+
+/*
+ * Drop the buffers a reader did not dequeue yet. Must be called with the
+ * fan-out lock held.
+ *
+ * Return: the number of buffers lost by the reader, including the ones its
+ * dropped buffers were already skipping
+ */
+static u32 psee_dma_reader_flush(struct psee_dma *dma, struct psee_dma_reader *reader,
+				 struct list_head *release)
+{
+	struct psee_dma_fanout_buffer *entry;
+	u32 skipped = 0;
+
+	while (reader->count) {
+		entry = &reader->pending[reader->first];
+		psee_dma_fanout_put(dma, psee_dma_fanout_buffer(dma, entry->index), release);
+		skipped += entry->skipped + 1;
+		reader->first = (reader->first + 1) % VB2_MAX_FRAME;
+		reader->count--;
+	}
+
+	return skipped;
+}
+
+/**
+ * psee_dma_fanout_complete - Give a filled buffer to the fan-out readers
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer, about to be given back to videobuf2
+ *
+ * Called from the capture completion path, for buffers completed without
+ * error. Each reader takes a reference on the buffer.
+ */
+void psee_dma_fanout_complete(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	struct psee_dma_fanout_buffer *entry;
+	struct psee_dma_reader *reader;
+	LIST_HEAD(release);
+	u32 skipped;
+
+	spin_lock(&fanout->lock);
+	if (!fanout->streaming) {
+		spin_unlock(&fanout->lock);
+		return;
+	}
+
+	list_for_each_entry(reader, &fanout->readers, list) {
+		skipped = 0;
+		if (reader->policy == PSEE_DMA_FANOUT_SKIP)
+			skipped = psee_dma_reader_flush(dma, reader, &release);
+		/* A buffer is not filled again before all readers released it */
+		if (WARN_ON(reader->count == VB2_MAX_FRAME))
+			continue;
+
+		entry = &reader->pending[(reader->first + reader->count) % VB2_MAX_FRAME];
+		entry->index = buf->buf.vb2_buf.index;
+		entry->sequence = buf->buf.sequence;
+		entry->bytesused = vb2_get_plane_payload(&buf->buf.vb2_buf, 0);
+		entry->flags = buf->buf.flags & (PSEE_BUF_FLAG_CLOSE_MASK | PSEE_BUF_FLAG_GAP);
+		entry->timestamp = buf->buf.vb2_buf.timestamp;
+		entry->skipped = skipped;
+		memset(entry->reserved, 0, sizeof(entry->reserved));
+		reader->count++;
+		buf->readers++;
+		wake_up_interruptible(&reader->wait);
+	}
+	spin_unlock(&fanout->lock);
+
+	psee_dma_fanout_submit(dma, &release);
+}
+
+/**
+ * psee_dma_fanout_park - Hold a queued buffer until the readers release it
+ * @dma: DMA channel the buffer is queued to
+ * @buf: the buffer queued by the owner
+ *
+ * Return: true if the buffer is parked, false if it can go to the DMA
+ */
+bool psee_dma_fanout_park(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	bool parked;
+
+	spin_lock_irq(&fanout->lock);
+	parked = buf->readers;
+	if (parked) {
+		buf->parked = true;
+		list_add_tail(&buf->queue, &fanout->parked);
+	}
+	spin_unlock_irq(&fanout->lock);
+
+	return parked;
+}
+
+void psee_dma_fanout_start(struct psee_dma *dma)
+{
+	spin_lock_irq(&dma->fanout.lock);
+	dma->fanout.streaming = true;
+	spin_unlock_irq(&dma->fanout.lock);
+}
+
+/*
+ * Drop the references of all readers, which stay attached for the next
+ * stream, and give back the parked buffers to videobuf2. Called before the DMA
+ * engine is terminated: the buffers still completing are not given to the
+ * readers, so none comes back to the DMA engine through a reader release.
+ */
+void psee_dma_fanout_stop(struct psee_dma *dma)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	struct psee_dma_buffer *buf, *nbuf;
+	struct psee_dma_reader *reader;
+	unsigned int i;
+
+	spin_lock_irq(&fanout->lock);
+	fanout->streaming = false;
+	list_for_each_entry(reader, &fanout->readers, list) {
+		reader->first = 0;
+		reader->count = 0;
+		bitmap_zero(reader->held, VB2_MAX_FRAME);
+		wake_up_interruptible(&reader->wait);
+	}
+	for (i = 0; i < dma->queue.num_buffers; i++)
+		psee_dma_fanout_buffer(dma, i)->readers = 0;
+	list_for_each_entry_safe(buf, nbuf, &fanout->parked, queue) {
+		list_del(&buf->queue);
+		buf->parked = false;
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+	}
+	spin_unlock_irq(&fanout->lock);
+}
+
+/**
+ * psee_dma_fanout_release - Detach a reader
+ * @dma: DMA channel the reader is attached to
+ * @fh: file handle of the reader
+ *
+ * The buffers held by the reader are released. Must be called with the video
+ * device lock held.
+ */
+void psee_dma_fanout_release(struct psee_dma *dma, struct psee_dma_fh *fh)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	struct psee_dma_reader *reader = &fh->reader;
+	LIST_HEAD(release);
+	unsigned int index;
+
+	spin_lock_irq(&fanout->lock);
+	if (!reader->attached) {
+		spin_unlock_irq(&fanout->lock);
+		return;
+	}
+
+	list_del_init(&reader->list);
+	reader->attached = false;
+	psee_dma_reader_flush(dma, reader, &release);
+	reader->first = 0;
+	for_each_set_bit(index, reader->held, VB2_MAX_FRAME)
+		psee_dma_fanout_put(dma, psee_dma_fanout_buffer(dma, index), &release);
+	bitmap_zero(reader->held, VB2_MAX_FRAME);
+	spin_unlock_irq(&fanout->lock);
+
+	/* Let a reader waiting on another thread know */
+	wake_up_interruptible(&reader->wait);
+	psee_dma_fanout_submit(dma, &release);
+}
+
+/* -----------------------------------------------------------------------------
+ * Reader file operations
+ */
+
+static int psee_dma_fanout_attach(struct psee_dma *dma, struct psee_dma_fh *fh,
+				  const struct psee_dma_fanout_attach *attach)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	struct psee_dma_reader *reader = &fh->reader;
+
+	if (dma->queue.type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		return -ENOTTY;
+	if (attach->policy > PSEE_DMA_FANOUT_SKIP ||
+	    memchr_inv(attach->reserved, 0, sizeof(attach->reserved)))
+		return -EINVAL;
+	/* Buffers of the ring are not completed one by one, and buffers of the
+	 * completion ring don't go through videobuf2
+	 */
+	if (dma->ring_periods || dma->cring.enabled)
+		return -EBUSY;
+	/* The owner of the queue gets the buffers with VIDIOC_DQBUF */
+	if (dma->queue.owner == &fh->fh)
+		return -EBUSY;
+
+	spin_lock_irq(&fanout->lock);
+	reader->policy = attach->policy;
+	if (!reader->attached) {
+		list_add_tail(&reader->list, &fanout->readers);
+		reader->attached = true;
+	}
+	spin_unlock_irq(&fanout->lock);
+
+	return 0;
+}
+
+static bool psee_dma_reader_ready(struct psee_dma *dma, struct psee_dma_reader *reader)
+{
+	bool ready;
+
+	spin_lock_irq(&dma->fanout.lock);
+	ready = reader->count || !reader->attached || !dma->fanout.streaming;
+	spin_unlock_irq(&dma->fanout.lock);
+
+	return ready;
+}
+
+static int psee_dma_fanout_dqbuf(struct psee_dma *dma, struct psee_dma_fh *fh,
+				 bool nonblocking, struct psee_dma_fanout_buffer *out)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	struct psee_dma_reader *reader = &fh->reader;
+	int ret;
+
+	for (;;) {
+		spin_lock_irq(&fanout->lock);
+		if (!reader->attached || !fanout->streaming) {
+			spin_unlock_irq(&fanout->lock);
+			return -EPIPE;
+		}
+		if (reader->count)
+			break;
+		spin_unlock_irq(&fanout->lock);
+
+		if (nonblocking)
+			return -EAGAIN;
+
+		/* Let the owner and the other readers in while waiting, as vb2 does */
+		mutex_unlock(&dma->lock);
+		ret = wait_event_interruptible(reader->wait,
+					       psee_dma_reader_ready(dma, reader));
+		mutex_lock(&dma->lock);
+		if (ret)
+			return ret;
+	}
+
+	*out = reader->pending[reader->first];
+	reader->first = (reader->first + 1) % VB2_MAX_FRAME;
+	reader->count--;
+	__set_bit(out->index, reader->held);
+	spin_unlock_irq(&fanout->lock);
+
+	return 0;
+}
+
+static int psee_dma_fanout_qbuf(struct psee_dma *dma, struct psee_dma_fh *fh,
+				const struct psee_dma_fanout_buffer *in)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	struct psee_dma_reader *reader = &fh->reader;
+	LIST_HEAD(release);
+
+	spin_lock_irq(&fanout->lock);
+	/* Buffers held at the end of the stream are already released */
+	if (in->index >= VB2_MAX_FRAME || !__test_and_clear_bit(in->index, reader->held)) {
+		spin_unlock_irq(&fanout->lock);
+		return -EINVAL;
+	}
+	psee_dma_fanout_put(dma, psee_dma_fanout_buffer(dma, in->index), &release);
+	spin_unlock_irq(&fanout->lock);
+
+	psee_dma_fanout_submit(dma, &release);
+	return 0;
+}
+
+/* Handle the fan-out ioctls, with the video device lock held */
+long psee_dma_fanout_ioctl(struct psee_dma *dma, struct psee_dma_fh *fh,
+			   struct file *file, unsigned int cmd, void *arg)
+{
+	switch (cmd) {
+	case PSEE_DMA_IOC_FANOUT_ATTACH:
+		return psee_dma_fanout_attach(dma, fh, arg);
+	case PSEE_DMA_IOC_FANOUT_DETACH:
+		psee_dma_fanout_release(dma, fh);
+		return 0;
+	case PSEE_DMA_IOC_FANOUT_DQBUF:
+		return psee_dma_fanout_dqbuf(dma, fh, file->f_flags & O_NONBLOCK, arg);
+	case PSEE_DMA_IOC_FANOUT_QBUF:
+		return psee_dma_fanout_qbuf(dma, fh, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+/*
+ * Poll of an attached reader, on its own buffers instead of the queue ones.
+ * Events are reported as vb2_poll() does.
+ */
+__poll_t psee_dma_fanout_poll(struct psee_dma *dma, struct psee_dma_fh *fh,
+			      struct file *file, poll_table *wait)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+	struct psee_dma_reader *reader = &fh->reader;
+	__poll_t req_events = poll_requested_events(wait);
+	__poll_t res = 0;
+
+	if (v4l2_event_pending(&fh->fh))
+		res = EPOLLPRI;
+	else if (req_events & EPOLLPRI)
+		poll_wait(file, &fh->fh.wait, wait);
+
+	if (!(req_events & (EPOLLIN | EPOLLRDNORM)))
+		return res;
+
+	poll_wait(file, &reader->wait, wait);
+
+	spin_lock_irq(&fanout->lock);
+	if (!reader->attached || !fanout->streaming)
+		res |= EPOLLERR;
+	else if (reader->count)
+		res |= EPOLLIN | EPOLLRDNORM;
+	spin_unlock_irq(&fanout->lock);
+
+	return res;
+}
+
+void psee_dma_fanout_init(struct psee_dma *dma)
+{
+	struct psee_dma_fanout *fanout = &dma->fanout;
+
+	spin_lock_init(&fanout->lock);
+	INIT_LIST_HEAD(&fanout->readers);
+	INIT_LIST_HEAD(&fanout->parked);
+}
@@ -0,0 +1,303 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Prophesee Video DMA metadata node
+ *
+ * A metadata capture node next to each capture DMA channel, carrying a
+ * struct psee_dma_meta record per capture buffer, with the same sequence
+ * number. Applications can then schedule or skip capture buffers without
+ * reading their payload.
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include <media/v4l2-dev.h>
+#include <media/v4l2-fh.h>
+#include <media/v4l2-ioctl.h>
+#include <media/videobuf2-v4l2.h>
+#include <media/videobuf2-vmalloc.h>
+
+#include "psee-dma.h"
+#include "psee-composite.h"
+#include "psee-format.h"
+#include "psee-uapi.h"
+
+/**
+ * struct psee_dma_meta_buffer - Metadata buffer
+ * @buf: vb2 buffer base object
+ * @queue: buffer list entry in the node queued buffers list
+ */
+struct psee_dma_meta_buffer {
+	struct vb2_v4l2_buffer buf;
+	struct list_head queue;
+};
+
+#define to_psee_dma_meta_buffer(vb)	container_of(vb, struct psee_dma_meta_buffer, buf)
+
+#define to_psee_dma_meta(m)		container_of(m, struct psee_dma, meta)
+
+/**
+ * psee_dma_meta_complete - Give a record to the metadata node
+ * @dma: DMA channel the record describes a buffer of
+ * @record: the record
+ *
+ * Called from the capture completion path. The record is dropped if no
+ * metadata buffer is queued.
+ */
+void psee_dma_meta_complete(struct psee_dma *dma, const struct psee_dma_meta *record)
+{
+	struct psee_dma_meta_node *meta = &dma->meta;
+	struct psee_dma_meta_buffer *buf;
+	void *vaddr;
+
+	spin_lock(&meta->queued_lock);
+	buf = list_first_entry_or_null(&meta->queued_bufs, struct psee_dma_meta_buffer,
+				       queue);
+	if (buf)
+		list_del(&buf->queue);
+	else
+		meta->dropped++;
+	spin_unlock(&meta->queued_lock);
+
+	if (!buf)
+		return;
+
+	vaddr = vb2_plane_vaddr(&buf->buf.vb2_buf, 0);
+	if (vaddr)
+		memcpy(vaddr, record, sizeof(*record));
+	vb2_set_plane_payload(&buf->buf.vb2_buf, 0, sizeof(*record));
+	buf->buf.field = V4L2_FIELD_NONE;
+	buf->buf.sequence = record->sequence;
+	buf->buf.vb2_buf.timestamp = record->timestamp;
+	vb2_buffer_done(&buf->buf.vb2_buf, vaddr ? VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR);
+}
+
+/* -----------------------------------------------------------------------------
+ * videobuf2 queue operations
+ */
+
+static int
+psee_dma_meta_queue_setup(struct vb2_queue *vq,
+			  unsigned int *nbuffers, unsigned int *nplanes,
+			  unsigned int sizes[], struct device *alloc_devs[])
+{
+	if (*nplanes)
+		return sizes[0] < sizeof(struct psee_dma_meta) ? -EINVAL : 0;
+
+	*nplanes = 1;
+	sizes[0] = sizeof(struct psee_dma_meta);
+
+	return 0;
+}
+
+static int psee_dma_meta_buffer_prepare(struct vb2_buffer *vb)
+{
+	if (vb2_plane_size(vb, 0) < sizeof(struct psee_dma_meta))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void psee_dma_meta_buffer_queue(struct vb2_buffer *vb)
+{
+	struct psee_dma_meta_node *meta = vb2_get_drv_priv(vb->vb2_queue);
+	struct psee_dma_meta_buffer *buf = to_psee_dma_meta_buffer(to_vb2_v4l2_buffer(vb));
+
+	spin_lock_irq(&meta->queued_lock);
+	list_add_tail(&buf->queue, &meta->queued_bufs);
+	spin_unlock_irq(&meta->queued_lock);
+}
+
+static int psee_dma_meta_start_streaming(struct vb2_queue *vq, unsigned int count)
+{
+	struct psee_dma_meta_node *meta = vb2_get_drv_priv(vq);
+
+	spin_lock_irq(&meta->queued_lock);
+	meta->dropped = 0;
+	spin_unlock_irq(&meta->queued_lock);
+
+	return 0;
+}
+
+static void psee_dma_meta_stop_streaming(struct vb2_queue *vq)
+{
+	struct psee_dma_meta_node *meta = vb2_get_drv_priv(vq);
+	struct psee_dma_meta_buffer *buf, *nbuf;
+
+	/* Give back all queued buffers to videobuf2. */
+	spin_lock_irq(&meta->queued_lock);
+	list_for_each_entry_safe(buf, nbuf, &meta->queued_bufs, queue) {
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+		list_del(&buf->queue);
+	}
+	spin_unlock_irq(&meta->queued_lock);
+}
+
+static const struct vb2_ops psee_dma_meta_queue_qops = {
+	.queue_setup = psee_dma_meta_queue_setup,
+	.buf_prepare = psee_dma_meta_buffer_prepare,
+	.buf_queue = psee_dma_meta_buffer_queue,
+	.wait_prepare = vb2_ops_wait_prepare,
+	.wait_finish = vb2_ops_wait_finish,
+	.start_streaming = psee_dma_meta_start_streaming,
+	.stop_streaming = psee_dma_meta_stop_streaming,
+};
+
+/* -----------------------------------------------------------------------------
+ * V4L2 ioctls
+ */
+
+static int
+psee_dma_meta_querycap(struct file *file, void *fh, struct v4l2_capability *cap)
+{
+	struct psee_dma_meta_node *meta = video_drvdata(file);
+	struct psee_dma *dma = to_psee_dma_meta(meta);
+
+	cap->capabilities = dma->psee_dev->v4l2_caps | V4L2_CAP_STREAMING |
+			    V4L2_CAP_DEVICE_CAPS;
+
+	/* Same bus info as the capture node, to pair them */
+	strscpy(cap->driver, "psee-dma", sizeof(cap->driver));
+	strscpy(cap->card, meta->video.name, sizeof(cap->card));
+	snprintf(cap->bus_info, sizeof(cap->bus_info), "platform:%pOFn:%u",
+		 dma->psee_dev->dev->of_node, dma->port);
+
+	return 0;
+}
+
+static int
+psee_dma_meta_enum_format(struct file *file, void *fh, struct v4l2_fmtdesc *f)
+{
+	if (f->index > 0)
+		return -EINVAL;
+
+	f->pixelformat = V4L2_META_FMT_PSEE_STATS;
+	return 0;
+}
+
+/* The format is fixed, getting, trying and setting it all return it */
+static int
+psee_dma_meta_get_format(struct file *file, void *fh, struct v4l2_format *format)
+{
+	format->fmt.meta.dataformat = V4L2_META_FMT_PSEE_STATS;
+	format->fmt.meta.buffersize = sizeof(struct psee_dma_meta);
+	return 0;
+}
+
+static int psee_dma_meta_log_status(struct file *file, void *fh)
+{
+	struct psee_dma_meta_node *meta = video_drvdata(file);
+	struct psee_dma *dma = to_psee_dma_meta(meta);
+	u32 dropped;
+
+	spin_lock_irq(&meta->queued_lock);
+	dropped = meta->dropped;
+	spin_unlock_irq(&meta->queued_lock);
+
+	dev_info(dma->psee_dev->dev, "%s: records dropped: %u\n",
+		 meta->video.name, dropped);
+	return 0;
+}
+
+static const struct v4l2_ioctl_ops psee_dma_meta_ioctl_ops = {
+	.vidioc_querycap		= psee_dma_meta_querycap,
+	.vidioc_enum_fmt_meta_cap	= psee_dma_meta_enum_format,
+	.vidioc_g_fmt_meta_cap		= psee_dma_meta_get_format,
+	.vidioc_s_fmt_meta_cap		= psee_dma_meta_get_format,
+	.vidioc_try_fmt_meta_cap	= psee_dma_meta_get_format,
+	.vidioc_reqbufs			= vb2_ioctl_reqbufs,
+	.vidioc_querybuf		= vb2_ioctl_querybuf,
+	.vidioc_qbuf			= vb2_ioctl_qbuf,
+	.vidioc_dqbuf			= vb2_ioctl_dqbuf,
+	.vidioc_create_bufs		= vb2_ioctl_create_bufs,
+	.vidioc_expbuf			= vb2_ioctl_expbuf,
+	.vidioc_streamon		= vb2_ioctl_streamon,
+	.vidioc_streamoff		= vb2_ioctl_streamoff,
+	.vidioc_log_status		= psee_dma_meta_log_status,
+};
+
+/* -----------------------------------------------------------------------------
+ * V4L2 file operations
+ */
+
+static const struct v4l2_file_operations psee_dma_meta_fops = {
+	.owner		= THIS_MODULE,
+	.unlocked_ioctl	= video_ioctl2,
+	.open		= v4l2_fh_open,
+	.release	= vb2_fop_release,
+	.poll		= vb2_fop_poll,
+	.mmap		= vb2_fop_mmap,
+};
+
+/* -----------------------------------------------------------------------------
+ * Metadata node Core
+ */
+
+/* On error, the node is cleaned up with its DMA, by psee_dma_cleanup() */
+int psee_dma_meta_init(struct psee_dma *dma)
+{
+	struct psee_dma_meta_node *meta = &dma->meta;
+	struct device *dev = dma->psee_dev->dev;
+	int ret;
+
+	mutex_init(&meta->lock);
+	INIT_LIST_HEAD(&meta->queued_bufs);
+	spin_lock_init(&meta->queued_lock);
+
+	meta->video.fops = &psee_dma_meta_fops;
+	meta->video.v4l2_dev = &dma->psee_dev->v4l2_dev;
+	meta->video.queue = &meta->queue;
+	snprintf(meta->video.name, sizeof(meta->video.name), "%s meta",
+		 dma->video.name);
+	meta->video.vfl_type = VFL_TYPE_VIDEO;
+	meta->video.vfl_dir = VFL_DIR_RX;
+	meta->video.release = video_device_release_empty;
+	meta->video.ioctl_ops = &psee_dma_meta_ioctl_ops;
+	meta->video.lock = &meta->lock;
+	meta->video.device_caps = V4L2_CAP_META_CAPTURE | V4L2_CAP_STREAMING;
+
+	video_set_drvdata(&meta->video, meta);
+
+	/* Records are small and only written by the CPU */
+	meta->queue.type = V4L2_BUF_TYPE_META_CAPTURE;
+	meta->queue.io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF;
+	meta->queue.lock = &meta->lock;
+	meta->queue.drv_priv = meta;
+	meta->queue.buf_struct_size = sizeof(struct psee_dma_meta_buffer);
+	meta->queue.ops = &psee_dma_meta_queue_qops;
+	meta->queue.mem_ops = &vb2_vmalloc_memops;
+	meta->queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+				    | V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+	meta->queue.dev = dev;
+	ret = vb2_queue_init(&meta->queue);
+	if (ret < 0) {
+		dev_err(dev, "failed to initialize metadata VB2 queue\n");
+		return ret;
+	}
+
+	ret = video_register_device(&meta->video, VFL_TYPE_VIDEO, -1);
+	if (ret < 0) {
+		dev_err(dev, "failed to register metadata video device\n");
+		return ret;
+	}
+
+	return 0;
+}
+
+void psee_dma_meta_cleanup(struct psee_dma *dma)
+{
+	struct psee_dma_meta_node *meta = &dma->meta;
+
+	/* Only capture DMAs have a metadata node, set up by psee_dma_meta_init() */
+	if (!meta->video.lock)
+		return;
+
+	if (video_is_registered(&meta->video))
+		video_unregister_device(&meta->video);
+
+	mutex_destroy(&meta->lock);
+}
@@ -5,22 +5,32 @@
  * Copyright (C) Prophesee S.A.
  */
 
+#include <linux/clk.h>
+#include <linux/dma-mapping.h>
+#include <linux/ktime.h>
 #include <linux/dma/xilinx_dma.h>
 #include <linux/lcm.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/of.h>
+#include <linux/property.h>
+#include <linux/sched/clock.h>
 #include <linux/slab.h>
 
 #include <media/v4l2-dev.h>
+#include <media/v4l2-event.h>
 #include <media/v4l2-fh.h>
 #include <media/v4l2-ioctl.h>
 #include <media/videobuf2-v4l2.h>
 #include <media/videobuf2-dma-contig.h>
+#include <media/videobuf2-dma-sg.h>
 
 #include "psee-dma.h"
 #include "psee-composite.h"
+#include "psee-csi2rxss.h"
 #include "psee-format.h"
+#include "psee-uapi.h"
 
 #define PSEE_DMA_DEF_WIDTH		1280
 #define PSEE_DMA_DEF_HEIGHT		720
@@ -34,6 +44,7 @@
 #define DEFAULT_PACKET_LENGTH		(1 << 20)
 
 #define REG_PACKETIZER_VERSION		(0x0)
+#define PACKETIZER_VERSION_IS_V2(ver)	(((ver) & ~0xFFFF) == 0x20000)
 #define REG_PACKETIZER_CONTROL		(0x4)
 #define ENABLE_COUNTER_PATTERN		BIT(0)
 #define ENABLE_TLAST_TIMEOUT		BIT(1)
@@ -43,8 +54,10 @@
 #define REG_PACKETIZER_TLAST_TIMEOUT_EVT_MSB	(0x10)
 #define REG_PACKETIZER_TLAST_TIMEOUT_EVT_LSB	(0x14)
 
-/* V4L2 Control codes */
-#define V4L2_CID_XFER_TIMEOUT_ENABLE	(V4L2_CID_USER_BASE | 0x1001)
+#define PSEE_DMA_MAX_RING_PERIODS	256
+
+/* Issued buffers ahead of the DMA, under which new buffers are issued at once */
+#define PSEE_DMA_ISSUE_AHEAD		2
 
 /*
  * Register related operations
@@ -87,6 +100,71 @@ static u32 mediabus_to_pixel(unsigned int code)
 	return pix;
 }
 
+/*
+ * In ring mode, the only buffer holds the ring followed by its status page. A
+ * packed buffer holds a packet slot per packet.
+ */
+static u64 __psee_dma_buffer_size(struct psee_dma *dma, u32 transfer_size)
+{
+	if (dma->ring_periods)
+		return (u64)dma->ring_periods * transfer_size + PAGE_SIZE;
+
+	return (u64)dma->packets * transfer_size;
+}
+
+static u64 psee_dma_buffer_size(struct psee_dma *dma)
+{
+	return __psee_dma_buffer_size(dma, dma->transfer_size);
+}
+
+/* A ring too large for sizeimage is refused when buffers are allocated */
+static u32 psee_dma_sizeimage(struct psee_dma *dma, u32 transfer_size)
+{
+	return min_t(u64, __psee_dma_buffer_size(dma, transfer_size), U32_MAX);
+}
+
+/* Transfers are done in whole pages, within the DMA engine capabilities */
+static u32 psee_dma_clamp_transfer_size(u32 size)
+{
+	size = clamp_t(u32, size, PSEE_DMA_MIN_TRANSFER_SIZE,
+		       PSEE_DMA_MAX_TRANSFER_SIZE);
+	return round_up(size, PAGE_SIZE);
+}
+
+/*
+ * The transfer size requested by a format, sizeimage being the size of the
+ * buffers. A sizeimage of 0 or of the current buffer size keeps the transfer
+ * size, so that the format read back may be set again unchanged.
+ *
+ * Return: the transfer size, or 0 to keep the current one
+ */
+static u32 psee_dma_sizeimage_request(struct psee_dma *dma, u32 sizeimage)
+{
+	if (!sizeimage || sizeimage == psee_dma_sizeimage(dma, dma->transfer_size))
+		return 0;
+
+	if (dma->ring_periods)
+		sizeimage = (sizeimage > PAGE_SIZE ? sizeimage - PAGE_SIZE : 0) /
+			    dma->ring_periods;
+	else
+		sizeimage /= dma->packets;
+
+	return psee_dma_clamp_transfer_size(sizeimage);
+}
+
+/* The packetizer timeout is counted in packetizer clock cycles */
+static u32 psee_dma_us_to_cycles(struct psee_dma *dma, u32 us)
+{
+	u64 cycles = div_u64((u64)us * dma->clk_rate, USEC_PER_SEC);
+
+	return min_t(u64, cycles, U32_MAX);
+}
+
+static u64 psee_dma_cycles_to_us(struct psee_dma *dma, u32 cycles)
+{
+	return div_u64((u64)cycles * USEC_PER_SEC, dma->clk_rate);
+}
+
 static struct v4l2_subdev *
 psee_dma_remote_subdev(struct media_pad *local, u32 *pad)
 {
@@ -117,97 +195,90 @@ static int psee_dma_verify_format(struct psee_dma *dma)
 	return 0;
 }
 
-/* -----------------------------------------------------------------------------
- * Pipeline Stream Management
+/*
+ * Symbol padding the packets closed on timeout, in both halves of the bus
+ * words. It must be an event the decoders of the format ignore.
  */
+static u32 psee_dma_format_filler(u32 code)
+{
+	switch (code) {
+	case MEDIA_BUS_FMT_PSEE_EVT2:
+		/* A 32-bit OTHERS event with no subtype */
+		return 0xE0000000;
+	case MEDIA_BUS_FMT_PSEE_EVT21ME:
+	case MEDIA_BUS_FMT_PSEE_EVT21:
+	case MEDIA_BUS_FMT_PSEE_EVT3:
+	default:
+		/*
+		 * A 64-bit OTHERS event in EVT 2.1, 16-bit ones in EVT 3.0. The
+		 * halves are the same, swapping them as EVT 2.1 ME does changes
+		 * nothing.
+		 */
+		return 0xE019E019;
+	}
+}
 
-/**
- * psee_pipeline_start_stop - Start ot stop streaming on a pipeline
- * @pipe: The pipeline
- * @start: Start (when true) or stop (when false) the pipeline
- *
- * Walk the entities chain starting at the pipeline output video node and start
- * or stop all of them.
- *
- * Return: 0 if successful, or the return value of the failed video::s_stream
- * operation otherwise.
+/* Media bus code of the format sent by the connected subdev, 0 if unknown */
+static u32 psee_dma_remote_code(struct psee_dma *dma)
+{
+	struct v4l2_subdev_format fmt = {
+		.which = V4L2_SUBDEV_FORMAT_ACTIVE,
+	};
+	struct v4l2_subdev *subdev;
+
+	subdev = psee_dma_remote_subdev(&dma->pad, &fmt.pad);
+	if (subdev == NULL || v4l2_subdev_call(subdev, pad, get_fmt, NULL, &fmt) < 0)
+		return 0;
+
+	return fmt.format.code;
+}
+
+/* Program the filler of a format */
+static void psee_dma_setup_filler(struct psee_dma *dma, u32 code)
+{
+	dma->filler[0] = psee_dma_format_filler(code);
+	dma->filler[1] = dma->filler[0];
+	write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT_EVT_LSB, dma->filler[0]);
+	write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT_EVT_MSB, dma->filler[1]);
+}
+
+/*
+ * Find the CSI-2 receiver upstream, if it reports its counters. Only the one of
+ * psee-csi2rxss.c has the private counters ioctl, which can be called from the
+ * completion path.
  */
-static int psee_pipeline_start_stop(struct psee_pipeline *pipe, bool start)
+static struct v4l2_subdev *psee_dma_find_csi2(struct psee_dma *dma)
 {
-	struct psee_dma *dma = pipe->output;
+	struct psee_csi2_counters counters;
 	struct media_entity *entity;
-	struct media_pad *pad;
 	struct v4l2_subdev *subdev;
-	int ret;
+	struct media_pad *pad;
 
 	entity = &dma->video.entity;
 	while (1) {
 		pad = &entity->pads[0];
 		if (!(pad->flags & MEDIA_PAD_FL_SINK))
-			break;
+			return NULL;
 
 		pad = media_entity_remote_pad(pad);
 		if (!pad || !is_media_entity_v4l2_subdev(pad->entity))
-			break;
+			return NULL;
 
 		entity = pad->entity;
 		subdev = media_entity_to_v4l2_subdev(entity);
+		if (!psee_csi2rxss_is(subdev))
+			continue;
 
-		ret = v4l2_subdev_call(subdev, video, s_stream, start);
-		if (start && ret < 0 && ret != -ENOIOCTLCMD)
-			return ret;
+		if (v4l2_subdev_call(subdev, core, ioctl, PSEE_CSI2_IOC_G_COUNTERS,
+				     &counters))
+			return NULL;
+		return subdev;
 	}
-
-	return 0;
 }
 
-/**
- * psee_pipeline_set_stream - Enable/disable streaming on a pipeline
- * @pipe: The pipeline
- * @on: Turn the stream on when true or off when false
- *
- * The pipeline is shared between all DMA engines connect at its input and
- * output. While the stream state of DMA engines can be controlled
- * independently, pipelines have a shared stream state that enable or disable
- * all entities in the pipeline. For this reason the pipeline uses a streaming
- * counter that tracks the number of DMA engines that have requested the stream
- * to be enabled.
- *
- * When called with the @on argument set to true, this function will increment
- * the pipeline streaming count. If the streaming count reaches the number of
- * DMA engines in the pipeline it will enable all entities that belong to the
- * pipeline.
- *
- * Similarly, when called with the @on argument set to false, this function will
- * decrement the pipeline streaming count and disable all entities in the
- * pipeline when the streaming count reaches zero.
- *
- * Return: 0 if successful, or the return value of the failed video::s_stream
- * operation otherwise. Stopping the pipeline never fails. The pipeline state is
- * not updated when the operation fails.
+/* -----------------------------------------------------------------------------
+ * Pipeline Stream Management
  */
-static int psee_pipeline_set_stream(struct psee_pipeline *pipe, bool on)
-{
-	int ret = 0;
-
-	mutex_lock(&pipe->lock);
-
-	if (on) {
-		if (pipe->stream_count == pipe->num_dmas - 1) {
-			ret = psee_pipeline_start_stop(pipe, true);
-			if (ret < 0)
-				goto done;
-		}
-		pipe->stream_count++;
-	} else {
-		if (--pipe->stream_count == 0)
-			psee_pipeline_start_stop(pipe, false);
-	}
-
-done:
-	mutex_unlock(&pipe->lock);
-	return ret;
-}
 
 static int psee_pipeline_validate(struct psee_pipeline *pipe,
 				  struct psee_dma *start)
@@ -215,7 +286,6 @@ static int psee_pipeline_validate(struct psee_pipeline *pipe,
 	struct media_graph graph;
 	struct media_entity *entity = &start->video.entity;
 	struct media_device *mdev = entity->graph_obj.mdev;
-	unsigned int num_inputs = 0;
 	unsigned int num_outputs = 0;
 	int ret;
 
@@ -238,47 +308,35 @@ static int psee_pipeline_validate(struct psee_pipeline *pipe,
 
 		dma = to_psee_dma(media_entity_to_video_device(entity));
 
-		if (dma->pad.flags & MEDIA_PAD_FL_SINK) {
-			pipe->output = dma;
+		if (dma->pad.flags & MEDIA_PAD_FL_SINK)
 			num_outputs++;
-		} else {
-			num_inputs++;
-		}
 	}
 
 	mutex_unlock(&mdev->graph_mutex);
 
 	media_graph_walk_cleanup(&graph);
 
-	/* We need exactly one output and zero or one input. */
-	if (num_outputs != 1 || num_inputs > 1)
+	/*
+	 * We need at least one output. Several outputs split the pipeline in
+	 * branches, each streaming on its own.
+	 */
+	if (!num_outputs)
 		return -EPIPE;
 
-	pipe->num_dmas = num_inputs + num_outputs;
-
 	return 0;
 }
 
-static void __psee_pipeline_cleanup(struct psee_pipeline *pipe)
-{
-	pipe->num_dmas = 0;
-	pipe->output = NULL;
-}
-
 /**
  * psee_pipeline_cleanup - Cleanup the pipeline after streaming
  * @pipe: the pipeline
  *
- * Decrease the pipeline use count and clean it up if we were the last user.
+ * Decrease the pipeline use count, the last user validates it again on its
+ * next start.
  */
 static void psee_pipeline_cleanup(struct psee_pipeline *pipe)
 {
 	mutex_lock(&pipe->lock);
-
-	/* If we're the last user clean up the pipeline. */
-	if (--pipe->use_count == 0)
-		__psee_pipeline_cleanup(pipe);
-
+	pipe->use_count--;
 	mutex_unlock(&pipe->lock);
 }
 
@@ -302,10 +360,8 @@ static int psee_pipeline_prepare(struct psee_pipeline *pipe,
 	/* If we're the first user validate and initialize the pipeline. */
 	if (pipe->use_count == 0) {
 		ret = psee_pipeline_validate(pipe, dma);
-		if (ret < 0) {
-			__psee_pipeline_cleanup(pipe);
+		if (ret < 0)
 			goto done;
-		}
 	}
 
 	pipe->use_count++;
@@ -316,67 +372,1704 @@ done:
 	return ret;
 }
 
+/* -----------------------------------------------------------------------------
+ * Adaptive packetization
+ *
+ * The controller lives in psee-dma-adapt.c, the packetizer is programmed here.
+ */
+
+static void psee_dma_adapt_apply(struct psee_dma *dma)
+{
+	write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT,
+		  psee_dma_us_to_cycles(dma, dma->adapt.timeout_us));
+	/* Set packet size in bus words */
+	write_reg(dma, REG_PACKETIZER_PACKET_LENGTH, dma->adapt.packet_length / 8);
+}
+
+/* -----------------------------------------------------------------------------
+ * On-demand flush
+ *
+ * The packetizer has no flush command. A flush opens a window during which the
+ * transfer timeout is a single cycle, and enabled: the packet holding data is
+ * closed at the first idle cycle of the stream. The window closes with the
+ * first packet closed, or after PSEE_DMA_FLUSH_WINDOW_US if the stream had no
+ * idle cycle or no data meanwhile. The previous settings are then restored,
+ * and read back.
+ */
+
+#define PSEE_DMA_FLUSH_WINDOW_US	1000
+
+/* Close the flush window, must be called with queued_lock held */
+static void psee_dma_flush_end(struct psee_dma *dma)
+{
+	struct psee_dma_flush *flush = &dma->flush;
+
+	if (!flush->pending)
+		return;
+
+	flush->pending = false;
+	write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT, flush->timeout);
+	write_reg(dma, REG_PACKETIZER_CONTROL, flush->control);
+	if (read_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT) != flush->timeout ||
+	    (read_reg(dma, REG_PACKETIZER_CONTROL) ^ flush->control) & ENABLE_TLAST_TIMEOUT) {
+		dma->stats.flush_restore_failed++;
+		dev_warn_ratelimited(dma->psee_dev->dev,
+				     "%s: transfer timeout not restored after a flush\n",
+				     dma->video.name);
+	}
+}
+
+/* -----------------------------------------------------------------------------
+ * Sensor to host time mapping
+ *
+ * Each completed buffer gives a sample, the sensor time of its last events and
+ * the host time of its completion. The host time is fitted as a linear
+ * function of the sensor time, by least squares over the last samples, the
+ * slope being stored as a drift from 1. The host time of a sample includes the
+ * transfer latency, so the fit does too, on average.
+ *
+ * Sums are done in microseconds relative to the oldest sample, and samples
+ * older than PSEE_DMA_FIT_MAX_SPAN_US are dropped, to keep them within 64
+ * bits.
+ */
+
+#define PSEE_DMA_FIT_MAX_SPAN_US	(1LL << 28)
+#define PSEE_DMA_FIT_MAX_DRIFT_PPB	1000000LL
+
+static void psee_dma_timefit_reset(struct psee_dma_timefit *fit)
+{
+	fit->first = 0;
+	fit->count = 0;
+	fit->drift_ppb = 0;
+}
+
+static void psee_dma_timefit_add(struct psee_dma_timefit *fit, u64 sensor_us, u64 host_ns)
+{
+	s64 sum_x = 0, sum_y = 0, sxx = 0, sxy = 0;
+	s64 mean_x, mean_y, dx, dy, diff;
+	unsigned int i, n, last;
+	u64 x0, y0;
+
+	if (fit->count) {
+		last = (fit->first + fit->count - 1) % PSEE_DMA_FIT_SAMPLES;
+		/* Nothing new */
+		if (sensor_us == fit->sensor_us[last])
+			return;
+		/* The sensor or the host clock went back, start over */
+		if (sensor_us < fit->sensor_us[last] || host_ns < fit->host_ns[last])
+			psee_dma_timefit_reset(fit);
+	}
+
+	n = (fit->first + fit->count) % PSEE_DMA_FIT_SAMPLES;
+	fit->sensor_us[n] = sensor_us;
+	fit->host_ns[n] = host_ns;
+	if (fit->count < PSEE_DMA_FIT_SAMPLES)
+		fit->count++;
+	else
+		fit->first = (fit->first + 1) % PSEE_DMA_FIT_SAMPLES;
+
+	while (fit->count > 1 &&
+	       (sensor_us - fit->sensor_us[fit->first] > PSEE_DMA_FIT_MAX_SPAN_US ||
+		host_ns - fit->host_ns[fit->first] > PSEE_DMA_FIT_MAX_SPAN_US * NSEC_PER_USEC)) {
+		fit->first = (fit->first + 1) % PSEE_DMA_FIT_SAMPLES;
+		fit->count--;
+	}
+
+	x0 = fit->sensor_us[fit->first];
+	y0 = fit->host_ns[fit->first];
+	for (i = 0; i < fit->count; i++) {
+		n = (fit->first + i) % PSEE_DMA_FIT_SAMPLES;
+		sum_x += fit->sensor_us[n] - x0;
+		sum_y += fit->host_ns[n] - y0;
+	}
+	mean_x = div_s64(sum_x, fit->count);
+	mean_y = div_s64(sum_y, fit->count);
+
+	for (i = 0; i < fit->count; i++) {
+		n = (fit->first + i) % PSEE_DMA_FIT_SAMPLES;
+		dx = fit->sensor_us[n] - x0 - mean_x;
+		dy = div_s64(fit->host_ns[n] - y0 - mean_y, NSEC_PER_USEC);
+		sxx += dx * dx;
+		sxy += dx * dy;
+	}
+
+	fit->sensor_ref_us = x0 + mean_x;
+	fit->host_ref_ns = y0 + mean_y;
+	fit->drift_ppb = 0;
+	if (sxx) {
+		diff = sxy - sxx;
+		fit->drift_ppb = mul_u64_u64_div_u64(abs(diff), NSEC_PER_SEC, sxx);
+		if (diff < 0)
+			fit->drift_ppb = -fit->drift_ppb;
+		fit->drift_ppb = clamp(fit->drift_ppb, -PSEE_DMA_FIT_MAX_DRIFT_PPB,
+				       PSEE_DMA_FIT_MAX_DRIFT_PPB);
+	}
+}
+
+static u64 psee_dma_timefit_map(const struct psee_dma_timefit *fit, u64 sensor_us)
+{
+	s64 dx = sensor_us - fit->sensor_ref_us;
+
+	return fit->host_ref_ns + dx * NSEC_PER_USEC +
+	       div_s64(dx * fit->drift_ppb, USEC_PER_SEC);
+}
+
 /* -----------------------------------------------------------------------------
  * videobuf2 queue operations
  */
 
+/*
+ * Account a closed buffer in the statistics, and tell why its packet was
+ * closed. The packetizer does not report it, so it is guessed from the payload
+ * and from the flush window, which the packet closes. Must be called with
+ * queued_lock held.
+ */
+static u32 psee_dma_close_reason(struct psee_dma *dma, u32 length, u32 payload)
+{
+	struct psee_dma_stats *stats = &dma->stats;
+	u32 packet_length = dma->adapt.target_us ? dma->adapt.packet_length
+						 : dma->transfer_size;
+	bool flushed = dma->flush.pending;
+
+	psee_dma_flush_end(dma);
+	stats->bytes += payload;
+
+	if (payload >= min(length, packet_length)) {
+		stats->full++;
+		stats->full_run++;
+		stats->max_full_run = max(stats->max_full_run, stats->full_run);
+		return PSEE_BUF_FLAG_CLOSE_FULL;
+	}
+
+	stats->full_run = 0;
+	if (flushed) {
+		stats->flush++;
+		return PSEE_BUF_FLAG_CLOSE_FLUSH;
+	}
+
+	stats->timeout++;
+	return PSEE_BUF_FLAG_CLOSE_TIMEOUT;
+}
+
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
 /**
- * struct psee_dma_buffer - Video DMA buffer
- * @buf: vb2 buffer base object
- * @queue: buffer list entry in the DMA engine queued buffers list
- * @dma: DMA channel that uses the buffer
- */
-struct psee_dma_buffer {
-	struct vb2_v4l2_buffer buf;
-	struct list_head queue;
-	struct psee_dma *dma;
-};
+ * psee_dma_buffer_sync - Make the payload of a non-coherent buffer visible
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer
+ * @payload: bytes transferred in the buffer
+ *
+ * videobuf2 would invalidate the whole buffer before giving it back to the
+ * CPU, while buffers ended on timeout are usually far from full. Invalidate
+ * only the payload, unless userspace asked for no invalidation at all. The
+ * videobuf2 flag is only set to skip its own invalidation, the hint of
+ * userspace is the one recorded when the buffer was queued.
+ *
+ * Return: true if the CPU already sees the payload, false if it will only
+ * once videobuf2 finishes the buffer
+ */
+static bool psee_dma_buffer_sync(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				 u32 payload)
+{
+	struct vb2_buffer *vb = &buf->buf.vb2_buf;
+	struct device *dev = dma->queue.dev;
+	struct scatterlist *sg;
+	struct sg_table *sgt;
+	int i;
+
+	/* Only MMAP contiguous buffers are coherent allocations */
+	if (!vb->vb2_queue->non_coherent_mem)
+		return dma->coherent || (!dma->use_sg && vb->memory == VB2_MEMORY_MMAP);
+
+	if (buf->no_invalidate)
+		return dma->coherent;
+
+	if (dma->coherent) {
+		vb->skip_cache_sync_on_finish = 1;
+		return true;
+	}
 
-#define to_psee_dma_buffer(vb)	container_of(vb, struct psee_dma_buffer, buf)
+	if (dma->use_sg) {
+		/* Sync by CPU pages, the DMA segments may be merged by an IOMMU */
+		sgt = vb2_dma_sg_plane_desc(vb, 0);
+		for_each_sg(sgt->sgl, sg, sgt->orig_nents, i) {
+			if (!payload)
+				break;
+			dma_sync_sg_for_cpu(dev, sg, 1, DMA_FROM_DEVICE);
+			payload -= min(payload, sg->length);
+		}
+	} else if (!device_iommu_mapped(dev)) {
+		/* Without IOMMU, contiguous buffers are contiguous in memory */
+		if (payload)
+			dma_sync_single_for_cpu(dev, vb2_dma_contig_plane_dma_addr(vb, 0),
+						payload, DMA_FROM_DEVICE);
+	} else {
+		/* Let videobuf2 handle the whole buffer */
+		return false;
+	}
 
-static void psee_dma_complete(void *param, const struct dmaengine_result *result)
+	vb->skip_cache_sync_on_finish = 1;
+	return true;
+}
+#else
+static inline bool psee_dma_buffer_sync(struct psee_dma *dma,
+					struct psee_dma_buffer *buf, u32 payload)
 {
-	struct psee_dma_buffer *buf = param;
-	struct psee_dma *dma = buf->dma;
+	return dma->coherent;
+}
+#endif
 
-	spin_lock(&dma->queued_lock);
-	list_del(&buf->queue);
-	spin_unlock(&dma->queued_lock);
+/*
+ * Get the bytes [offset, offset + len) of a buffer whose payload is visible to
+ * the CPU, copied in @chunk when the buffer is a scatter-gather list, so that
+ * it needs no kernel mapping in the completion tasklet.
+ */
+static const void *psee_dma_buffer_read(struct psee_dma *dma, struct psee_dma_buffer *buf,
+					u32 offset, void *chunk, u32 len)
+{
+	struct vb2_buffer *vb = &buf->buf.vb2_buf;
+	struct sg_table *sgt;
+	void *vaddr;
+
+	if (dma->use_sg) {
+		sgt = vb2_dma_sg_plane_desc(vb, 0);
+		if (sg_pcopy_to_buffer(sgt->sgl, sgt->orig_nents, chunk, len,
+				       offset) != len)
+			return NULL;
+		return chunk;
+	}
 
-	buf->buf.field = V4L2_FIELD_NONE;
-	buf->buf.sequence = dma->sequence++;
-	buf->buf.vb2_buf.timestamp = ktime_get_ns();
-	vb2_set_plane_payload(&buf->buf.vb2_buf, 0, dma->transfer_size - result->residue);
-	vb2_buffer_done(&buf->buf.vb2_buf,
-		result->result == DMA_TRANS_NOERROR ? VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR);
+	/* Imported buffers may have no kernel mapping */
+	vaddr = vb2_plane_vaddr(vb, 0);
+	return vaddr ? vaddr + offset : NULL;
 }
 
-static int
-psee_dma_queue_setup(struct vb2_queue *vq,
-		     unsigned int *nbuffers, unsigned int *nplanes,
-		     unsigned int sizes[], struct device *alloc_devs[])
+/**
+ * psee_dma_strip_filler - Find the end of the data in a packet closed on timeout
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer, its payload visible to the CPU
+ * @payload: bytes transferred in the buffer
+ *
+ * On timeout, the packetizer pads the packet with its filler symbols, the LSB
+ * and MSB halves of 64-bit bus words. The packetizer does not report the
+ * filler length, so scan the payload backward.
+ *
+ * Return: the payload without the trailing filler words
+ */
+static u32 psee_dma_strip_filler(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				 u32 payload)
 {
-	struct psee_dma *dma = vb2_get_drv_priv(vq);
+	const __le32 *words;
+	__le32 chunk[32];
+	u32 end = payload;
+	u32 len, i;
+
+	/* Only whole bus words are padded */
+	if (payload % 8)
+		return payload;
+
+	while (end) {
+		len = min_t(u32, end, sizeof(chunk));
+		words = psee_dma_buffer_read(dma, buf, end - len, chunk, len);
+		if (!words)
+			break;
 
-	/* Make sure the image size is large enough. */
-	if (*nplanes)
-		return sizes[0] < dma->transfer_size ? -EINVAL : 0;
+		for (i = len / 4; i; i--)
+			if (le32_to_cpu(words[i - 1]) != dma->filler[(i - 1) & 1])
+				return end - len + i * 4;
+		end -= len;
+	}
 
-	*nplanes = 1;
-	sizes[0] = dma->transfer_size;
+	return end;
+}
 
-	return 0;
+/*
+ * Decoder state tracking
+ *
+ * EVT 3.0 is stateful: the time high, time low, y address and vector base
+ * carry over from a buffer to the next one. The state at the start of each
+ * buffer is the state at the end of the previous one, which is found by
+ * scanning the previous buffer backward, until the last event of each kind.
+ * Event types are in the upper 4 bits of the 16-bit EVT 3.0 and 32-bit
+ * EVT 2.0 words, fillers are OTHERS events and are ignored.
+ */
+
+#define EVT2_TIME_HIGH			0x8
+#define EVT3_ADDR_Y			0x0
+#define EVT3_VECT_BASE_X		0x3
+#define EVT3_VECT_12			0x4
+#define EVT3_VECT_8			0x5
+#define EVT3_TIME_LOW			0x6
+#define EVT3_TIME_HIGH			0x8
+#define EVT3_VECT_BASE_X_MASK		0x7FF
+
+#define PSEE_DECODER_EVT3_ALL		(PSEE_DECODER_TIME_HIGH | PSEE_DECODER_TIME_LOW | \
+					 PSEE_DECODER_ADDR_Y | PSEE_DECODER_VECT_BASE_X)
+
+/* Move the x of a VECT_BASE_X word past the vectors decoded from it */
+static u32 psee_dma_evt3_vect_advance(u32 word, u32 vectors)
+{
+	return (word & ~EVT3_VECT_BASE_X_MASK) |
+	       ((word + vectors) & EVT3_VECT_BASE_X_MASK);
 }
 
-static int psee_dma_buffer_prepare(struct vb2_buffer *vb)
+static bool psee_dma_evt3_scan(struct psee_dma *dma, struct psee_dma_buffer *buf,
+			       u32 payload)
 {
-	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
-	struct psee_dma *dma = vb2_get_drv_priv(vb->vb2_queue);
-	struct psee_dma_buffer *buf = to_psee_dma_buffer(vbuf);
+	struct psee_dma_decoder_state *state = &dma->decoder;
+	u32 end = round_down(payload, 2);
+	u32 found = 0, vectors = 0;
+	const __le16 *words;
+	__le16 chunk[64];
+	u32 len, i;
+	u16 word;
+
+	while (end && found != PSEE_DECODER_EVT3_ALL) {
+		len = min_t(u32, end, sizeof(chunk));
+		words = psee_dma_buffer_read(dma, buf, end - len, chunk, len);
+		if (!words)
+			return false;
+
+		for (i = len / 2; i && found != PSEE_DECODER_EVT3_ALL; i--) {
+			word = le16_to_cpu(words[i - 1]);
+			switch (word >> 12) {
+			case EVT3_TIME_HIGH:
+				if (!(found & PSEE_DECODER_TIME_HIGH))
+					state->time_high = word;
+				found |= PSEE_DECODER_TIME_HIGH;
+				break;
+			case EVT3_TIME_LOW:
+				if (!(found & PSEE_DECODER_TIME_LOW))
+					state->time_low = word;
+				found |= PSEE_DECODER_TIME_LOW;
+				break;
+			case EVT3_ADDR_Y:
+				if (!(found & PSEE_DECODER_ADDR_Y))
+					state->addr_y = word;
+				found |= PSEE_DECODER_ADDR_Y;
+				break;
+			case EVT3_VECT_BASE_X:
+				if (!(found & PSEE_DECODER_VECT_BASE_X))
+					state->vect_base_x =
+						psee_dma_evt3_vect_advance(word, vectors);
+				found |= PSEE_DECODER_VECT_BASE_X;
+				break;
+			case EVT3_VECT_12:
+				vectors += 12;
+				break;
+			case EVT3_VECT_8:
+				vectors += 8;
+				break;
+			}
+		}
+		end -= len;
+	}
+
+	/* The vectors of this buffer moved the base of a previous one */
+	if (!(found & PSEE_DECODER_VECT_BASE_X))
+		state->vect_base_x = psee_dma_evt3_vect_advance(state->vect_base_x,
+								vectors);
+	state->valid |= found;
+	return true;
+}
+
+static bool psee_dma_evt2_scan(struct psee_dma *dma, struct psee_dma_buffer *buf,
+			       u32 payload)
+{
+	struct psee_dma_decoder_state *state = &dma->decoder;
+	u32 end = round_down(payload, 4);
+	const __le32 *words;
+	__le32 chunk[32];
+	u32 len, i, word;
+
+	while (end) {
+		len = min_t(u32, end, sizeof(chunk));
+		words = psee_dma_buffer_read(dma, buf, end - len, chunk, len);
+		if (!words)
+			return false;
+
+		for (i = len / 4; i; i--) {
+			word = le32_to_cpu(words[i - 1]);
+			if (word >> 28 == EVT2_TIME_HIGH) {
+				state->time_high = word;
+				state->valid |= PSEE_DECODER_TIME_HIGH;
+				return true;
+			}
+		}
+		end -= len;
+	}
+
+	return true;
+}
+
+/**
+ * psee_dma_decoder_update - Track the decoder state across a completed buffer
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer
+ * @payload: bytes transferred in the buffer
+ * @visible: the CPU sees the payload
+ *
+ * Attach the current state to the buffer, as the state at its start, then move
+ * the current state to the end of the buffer. The state is lost when a buffer
+ * can not be scanned, until the events are seen again.
+ */
+static void psee_dma_decoder_update(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				    u32 payload, bool visible)
+{
+	bool scanned;
+
+	buf->info.decoder = dma->decoder;
+	if (!payload)
+		return;
+
+	switch (visible ? dma->code : 0) {
+	case MEDIA_BUS_FMT_PSEE_EVT3:
+		scanned = psee_dma_evt3_scan(dma, buf, payload);
+		break;
+	case MEDIA_BUS_FMT_PSEE_EVT2:
+		scanned = psee_dma_evt2_scan(dma, buf, payload);
+		break;
+	default:
+		scanned = false;
+		break;
+	}
+
+	if (!scanned) {
+		memset(&dma->decoder, 0, sizeof(dma->decoder));
+		dma->sensor_valid = false;
+		psee_dma_timefit_reset(&dma->timefit);
+	}
+}
+
+/*
+ * Sensor time
+ *
+ * The time of the last events of a buffer is the time of the decoder state at
+ * its end. The time of its first events is the time of the state at its start,
+ * moved by the time words preceding the first event of the buffer.
+ */
+
+#define EVT3_ADDR_X			0x2
+#define EVT3_EXT_TRIGGER		0xA
+
+/* Apply to @state the time words at the head of the buffer */
+static void psee_dma_head_time(struct psee_dma *dma, struct psee_dma_buffer *buf,
+			       u32 payload, struct psee_dma_decoder_state *state)
+{
+	const __le16 *words;
+	__le16 chunk[64];
+	u32 len, i;
+	u16 word;
+
+	/* EVT 2.0 events carry their own time, only EVT 3.0 needs a scan */
+	if (dma->code != MEDIA_BUS_FMT_PSEE_EVT3)
+		return;
+
+	len = min_t(u32, round_down(payload, 2), sizeof(chunk));
+	words = psee_dma_buffer_read(dma, buf, 0, chunk, len);
+	if (!words)
+		return;
+
+	for (i = 0; i < len / 2; i++) {
+		word = le16_to_cpu(words[i]);
+		switch (word >> 12) {
+		case EVT3_TIME_HIGH:
+			state->time_high = word;
+			state->valid |= PSEE_DECODER_TIME_HIGH;
+			break;
+		case EVT3_TIME_LOW:
+			state->time_low = word;
+			state->valid |= PSEE_DECODER_TIME_LOW;
+			break;
+		case EVT3_ADDR_X:
+		case EVT3_VECT_12:
+		case EVT3_VECT_8:
+		case EVT3_EXT_TRIGGER:
+			return;
+		}
+	}
+}
+
+/* Unwrapped sensor time of a decoder state, in us */
+static bool psee_dma_state_time(struct psee_dma *dma,
+				const struct psee_dma_decoder_state *state, u64 *time)
+{
+	unsigned int bits;
+	u64 raw;
+
+	switch (dma->code) {
+	case MEDIA_BUS_FMT_PSEE_EVT3:
+		if ((state->valid & (PSEE_DECODER_TIME_HIGH | PSEE_DECODER_TIME_LOW)) !=
+		    (PSEE_DECODER_TIME_HIGH | PSEE_DECODER_TIME_LOW))
+			return false;
+		raw = (state->time_high & 0xFFF) << 12 | (state->time_low & 0xFFF);
+		bits = 24;
+		break;
+	case MEDIA_BUS_FMT_PSEE_EVT2:
+		if (!(state->valid & PSEE_DECODER_TIME_HIGH))
+			return false;
+		raw = (u64)(state->time_high & 0xFFFFFFF) << 6;
+		bits = 34;
+		break;
+	default:
+		return false;
+	}
+
+	/* Take the closest time to the last one seen */
+	if (dma->sensor_valid)
+		raw = dma->sensor_us + sign_extend64((raw - dma->sensor_us) &
+						     GENMASK_ULL(bits - 1, 0), bits - 1);
+	dma->sensor_us = raw;
+	dma->sensor_valid = true;
+	*time = raw;
+	return true;
+}
+
+/* The completion time of a buffer, in the clock chosen by the userspace */
+static u64 psee_dma_clock_ns(struct psee_dma *dma, u64 monotonic_ns)
+{
+	switch (dma->clock) {
+	case PSEE_DMA_CLOCK_BOOTTIME:
+		return ktime_to_ns(ktime_mono_to_any(ns_to_ktime(monotonic_ns), TK_OFFS_BOOT));
+	case PSEE_DMA_CLOCK_TAI:
+		return ktime_to_ns(ktime_mono_to_any(ns_to_ktime(monotonic_ns), TK_OFFS_TAI));
+	default:
+		return monotonic_ns;
+	}
+}
+
+/**
+ * psee_dma_time_update - Set the sensor and host times of a completed buffer
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer, its decoder state at start set
+ * @payload: bytes transferred in the buffer
+ * @now: completion time of the buffer (CLOCK_MONOTONIC, in ns)
+ *
+ * Must be called after psee_dma_decoder_update().
+ */
+static void psee_dma_time_update(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				 u32 payload, u64 now)
+{
+	struct psee_dma_buffer_info *info = &buf->info;
+	struct psee_dma_decoder_state head = info->decoder;
+
+	info->flags = 0;
+	if (!(dma->decoder.valid & PSEE_DECODER_TIME_HIGH))
+		return;
+
+	psee_dma_head_time(dma, buf, payload, &head);
+	if (!psee_dma_state_time(dma, &head, &info->sensor_first_us) ||
+	    !psee_dma_state_time(dma, &dma->decoder, &info->sensor_last_us))
+		return;
+	info->flags |= PSEE_BUFINFO_SENSOR_TIME;
+
+	psee_dma_timefit_add(&dma->timefit, info->sensor_last_us,
+			     psee_dma_clock_ns(dma, now));
+	info->first_ns = psee_dma_timefit_map(&dma->timefit, info->sensor_first_us);
+	info->last_ns = psee_dma_timefit_map(&dma->timefit, info->sensor_last_us);
+	info->flags |= PSEE_BUFINFO_HOST_TIME;
+}
+
+/*
+ * In-flight buffers
+ *
+ * The DMA engine completes the transfers in the order they were submitted, the
+ * buffers given to it are tracked in a ring rather than a list, so that the
+ * depth is known without walking the queue. All helpers must be called with
+ * queued_lock held.
+ */
+
+static void psee_dma_inflight_push(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct psee_dma_inflight *ring = &dma->inflight;
+
+	ring->bufs[ring->head++ % VB2_MAX_FRAME] = buf;
+}
+
+static struct psee_dma_buffer *psee_dma_inflight_peek(struct psee_dma *dma)
+{
+	struct psee_dma_inflight *ring = &dma->inflight;
+
+	if (ring->tail == ring->head)
+		return NULL;
+
+	return ring->bufs[ring->tail % VB2_MAX_FRAME];
+}
+
+static struct psee_dma_buffer *psee_dma_inflight_pop(struct psee_dma *dma)
+{
+	struct psee_dma_buffer *buf = psee_dma_inflight_peek(dma);
+
+	if (buf)
+		dma->inflight.tail++;
+
+	return buf;
+}
+
+static u32 psee_dma_queue_depth(struct psee_dma *dma)
+{
+	return dma->inflight.head - dma->inflight.tail;
+}
+
+/*
+ * Take queued_lock, counting how often it is found held. The hold time needs a
+ * clock read on each side, it is only accounted in debug builds. The plain
+ * variants leave interrupts as they are, the caller disables them if needed.
+ *
+ * Return: the time the lock was taken at, 0 when not accounted
+ */
+#ifdef CONFIG_VIDEO_ADV_DEBUG
+static u64 psee_dma_lock_account(struct psee_dma *dma, bool contended)
+{
+	dma->stats.lock_taken++;
+	dma->stats.lock_contended += contended;
+
+	return local_clock();
+}
+
+static void psee_dma_unlock_account(struct psee_dma *dma, u64 locked)
+{
+	u64 held = local_clock() - locked;
+
+	dma->stats.lock_hold_ns += held;
+	dma->stats.lock_max_hold_ns = max(dma->stats.lock_max_hold_ns, held);
+}
+#else
+static u64 psee_dma_lock_account(struct psee_dma *dma, bool contended)
+{
+	dma->stats.lock_taken++;
+	dma->stats.lock_contended += contended;
+
+	return 0;
+}
+
+static void psee_dma_unlock_account(struct psee_dma *dma, u64 locked)
+{
+}
+#endif
+
+static u64 psee_dma_queued_lock(struct psee_dma *dma)
+{
+	bool contended = !spin_trylock(&dma->queued_lock);
+
+	if (contended)
+		spin_lock(&dma->queued_lock);
+	return psee_dma_lock_account(dma, contended);
+}
+
+static u64 psee_dma_queued_lock_irq(struct psee_dma *dma)
+{
+	bool contended = !spin_trylock_irq(&dma->queued_lock);
+
+	if (contended)
+		spin_lock_irq(&dma->queued_lock);
+	return psee_dma_lock_account(dma, contended);
+}
+
+static void psee_dma_queued_unlock(struct psee_dma *dma, u64 locked)
+{
+	psee_dma_unlock_account(dma, locked);
+	spin_unlock(&dma->queued_lock);
+}
+
+static void psee_dma_queued_unlock_irq(struct psee_dma *dma, u64 locked)
+{
+	psee_dma_unlock_account(dma, locked);
+	spin_unlock_irq(&dma->queued_lock);
+}
+
+/* The flush window lapsed without any packet closed */
+static enum hrtimer_restart psee_dma_flush_timer(struct hrtimer *timer)
+{
+	struct psee_dma *dma = container_of(timer, struct psee_dma, flush.timer);
+	u64 locked;
+
+	locked = psee_dma_queued_lock(dma);
+	if (dma->flush.pending)
+		dma->stats.flush_lapsed++;
+	psee_dma_flush_end(dma);
+	psee_dma_queued_unlock(dma, locked);
+
+	return HRTIMER_NORESTART;
+}
+
+/* Open a flush window, unless one is open already */
+static void psee_dma_flush_request(struct psee_dma *dma)
+{
+	struct psee_dma_flush *flush = &dma->flush;
+	u64 locked;
+
+	locked = psee_dma_queued_lock_irq(dma);
+	if (flush->enabled && !flush->pending) {
+		flush->control = read_reg(dma, REG_PACKETIZER_CONTROL);
+		flush->timeout = read_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT);
+		write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT, 1);
+		write_reg(dma, REG_PACKETIZER_CONTROL, flush->control | ENABLE_TLAST_TIMEOUT);
+		flush->pending = true;
+		hrtimer_start(&flush->timer, us_to_ktime(PSEE_DMA_FLUSH_WINDOW_US),
+			      HRTIMER_MODE_REL_SOFT);
+	}
+	psee_dma_queued_unlock_irq(dma, locked);
+}
+
+/* Allow flushes while the stream runs, the settings are restored when it stops */
+static void psee_dma_flush_enable(struct psee_dma *dma, bool enable)
+{
+	u64 locked;
+
+	locked = psee_dma_queued_lock_irq(dma);
+	dma->flush.enabled = enable;
+	psee_dma_flush_end(dma);
+	psee_dma_queued_unlock_irq(dma, locked);
+
+	if (!enable)
+		hrtimer_cancel(&dma->flush.timer);
+}
+
+/*
+ * Overflow scratch buffer
+ *
+ * Once the last queued buffer completes, the DMA stops accepting data and the
+ * back-pressure overflows the CSI-2 receiver, which stays disabled until the
+ * stream restarts. Instead, a driver buffer is queued and requeued until the
+ * userspace queues a buffer again. Its data is dropped, and the next completed
+ * buffer is flagged as following a gap.
+ */
+
+static void psee_dma_scratch_free(struct psee_dma *dma)
+{
+	struct psee_dma_scratch *scratch = &dma->scratch;
+
+	if (!scratch->vaddr)
+		return;
+
+	dma_free_coherent(dma->dma->device->dev, scratch->size, scratch->vaddr,
+			  scratch->addr);
+	scratch->vaddr = NULL;
+}
+
+/*
+ * Attach the buffer at stream start. It is allocated by the first stream and
+ * kept for the next ones, until the transfer size changes. If the allocation
+ * fails, the stream runs without it, and the next one tries again.
+ */
+static void psee_dma_scratch_attach(struct psee_dma *dma)
+{
+	struct psee_dma_scratch *scratch = &dma->scratch;
+	u64 locked;
+
+	if (scratch->vaddr && scratch->size != dma->transfer_size)
+		psee_dma_scratch_free(dma);
+
+	if (!scratch->vaddr) {
+		scratch->vaddr = dma_alloc_coherent(dma->dma->device->dev,
+						    dma->transfer_size, &scratch->addr,
+						    GFP_KERNEL);
+		if (scratch->vaddr)
+			scratch->size = dma->transfer_size;
+		else
+			dev_warn(dma->psee_dev->dev,
+				 "No scratch buffer, the pipeline stalls if no buffer is queued\n");
+	}
+
+	locked = psee_dma_queued_lock_irq(dma);
+	scratch->attached = !!scratch->vaddr;
+	scratch->active = false;
+	scratch->gap = false;
+	psee_dma_queued_unlock_irq(dma, locked);
+}
+
+/*
+ * Detach the buffer under the lock, so that completions stop requeuing it.
+ * Called before terminating the DMA transfers.
+ */
+static void psee_dma_scratch_detach(struct psee_dma *dma)
+{
+	struct psee_dma_scratch *scratch = &dma->scratch;
+	u64 locked;
+
+	locked = psee_dma_queued_lock_irq(dma);
+	scratch->attached = false;
+	scratch->active = false;
+	psee_dma_queued_unlock_irq(dma, locked);
+}
+
+static bool psee_dma_scratch_queue(struct psee_dma *dma);
+
+static void psee_dma_scratch_complete(void *param, const struct dmaengine_result *result)
+{
+	struct psee_dma *dma = param;
+	struct psee_dma_scratch *scratch = &dma->scratch;
+	bool requeue;
+	u64 locked;
+
+	locked = psee_dma_queued_lock(dma);
+	scratch->active = false;
+	scratch->gap = true;
+	dma->stats.dropped++;
+	if (result->residue < scratch->size)
+		dma->stats.dropped_bytes += scratch->size - result->residue;
+	/* The transfer into the next buffer starts now */
+	dma->active_ns = ktime_get_ns();
+	requeue = !psee_dma_queue_depth(dma) && psee_dma_scratch_queue(dma);
+	psee_dma_queued_unlock(dma, locked);
+
+	if (requeue)
+		dma_async_issue_pending(dma->dma);
+}
+
+/*
+ * Submit a transfer into the scratch buffer, if there is one. Must be called
+ * with queued_lock held, the caller then issues the pending transfers.
+ *
+ * Return: true if a transfer was submitted
+ */
+static bool psee_dma_scratch_queue(struct psee_dma *dma)
+{
+	struct psee_dma_scratch *scratch = &dma->scratch;
+	struct dma_async_tx_descriptor *desc;
+
+	if (!scratch->attached)
+		return false;
+
+	desc = dmaengine_prep_slave_single(dma->dma, scratch->addr, scratch->size,
+					   DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!desc)
+		return false;
+	desc->callback_result = psee_dma_scratch_complete;
+	desc->callback_param = dma;
+	dmaengine_submit(desc);
+	scratch->active = true;
+
+	return true;
+}
+
+/*
+ * Queue depth watermark
+ *
+ * Events fire when the number of buffers queued to the DMA falls under the
+ * watermark, and when it gets back to it, so that the userspace can react
+ * before the scratch buffer starts dropping data.
+ */
+
+/*
+ * Compare the queue depth to the watermark, and prepare the event to send if
+ * it crossed it. Must be called with queued_lock held, the caller sends the
+ * event once the lock is released.
+ *
+ * Return: true if the event must be sent
+ */
+static bool psee_dma_watermark_update(struct psee_dma *dma, u32 depth,
+				      struct v4l2_event *event)
+{
+	struct psee_dma_event_queue *data = (void *)event->u.data;
+	bool low = depth < dma->watermark;
+
+	if (low == dma->queue_low)
+		return false;
+	dma->queue_low = low;
+
+	memset(event, 0, sizeof(*event));
+	event->type = low ? V4L2_EVENT_PSEE_QUEUE_LOW : V4L2_EVENT_PSEE_QUEUE_RECOVERED;
+	data->depth = depth;
+	data->watermark = dma->watermark;
+	data->sequence = dma->sequence;
+
+	return true;
+}
+
+/* Give the statistics of a completed buffer to the metadata node */
+static void psee_dma_meta_record(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				 u32 latency_us, u32 depth)
+{
+	struct psee_dma_meta record = {
+		.sequence = buf->buf.sequence,
+		.index = buf->buf.vb2_buf.index,
+		.bytesused = vb2_get_plane_payload(&buf->buf.vb2_buf, 0),
+		.flags = buf->buf.flags & (PSEE_BUF_FLAG_CLOSE_MASK | PSEE_BUF_FLAG_GAP),
+		.timestamp = buf->buf.vb2_buf.timestamp,
+		.latency_us = latency_us,
+		.queue_depth = depth,
+		.info_flags = PSEE_BUFINFO_CPU,
+		.cpu = buf->info.cpu,
+	};
+
+	if (dma->track_decoder && buf->info.flags & PSEE_BUFINFO_SENSOR_TIME) {
+		record.info_flags |= PSEE_BUFINFO_SENSOR_TIME;
+		record.sensor_first_us = buf->info.sensor_first_us;
+		record.sensor_last_us = buf->info.sensor_last_us;
+	}
+
+	/* Runs in the completion path, the counters are read without sleeping */
+	if (dma->csi2)
+		v4l2_subdev_call(dma->csi2, core, ioctl, PSEE_CSI2_IOC_G_COUNTERS,
+				 &record.csi2);
+
+	psee_dma_meta_complete(dma, &record);
+}
+
+/*
+ * Process a completed capture buffer: cache maintenance, payload scan and
+ * statistics, then delivery. Runs in the DMA callback or on the completion
+ * CPUs, a buffer at a time in completion order.
+ */
+static void psee_dma_complete_process(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct psee_dma_done *done = &buf->done;
+	u64 now = buf->buf.vb2_buf.timestamp;
+	u32 payload = done->payload;
+	bool visible;
+
+	visible = psee_dma_buffer_sync(dma, buf, payload);
+	/* The data of a packed buffer has holes, it can't be scanned as a whole */
+	if (visible && dma->strip_filler && !buf->packets &&
+	    (buf->buf.flags & PSEE_BUF_FLAG_CLOSE_MASK) != PSEE_BUF_FLAG_CLOSE_FULL)
+		payload = psee_dma_strip_filler(dma, buf, payload);
+	if (dma->track_decoder && !buf->packets) {
+		/* The decoder state is lost with the dropped data */
+		if (buf->buf.flags & PSEE_BUF_FLAG_GAP) {
+			memset(&dma->decoder, 0, sizeof(dma->decoder));
+			dma->sensor_valid = false;
+			psee_dma_timefit_reset(&dma->timefit);
+		} else if (done->failed) {
+			memset(&dma->decoder, 0, sizeof(dma->decoder));
+		}
+		psee_dma_decoder_update(dma, buf, payload, visible);
+		psee_dma_time_update(dma, buf, payload, now);
+	} else {
+		buf->info.flags = 0;
+	}
+	buf->info.cpu = raw_smp_processor_id();
+	buf->info.flags |= PSEE_BUFINFO_CPU;
+	vb2_set_plane_payload(&buf->buf.vb2_buf, 0, payload);
+	if (vb2_is_streaming(&dma->meta.queue))
+		psee_dma_meta_record(dma, buf, done->latency_us, done->depth);
+	psee_dma_coalesce_complete(dma, buf, done->failed, now);
+}
+
+/*
+ * Completion steering
+ *
+ * The processing of the completed capture buffers may be moved from the DMA
+ * callback to chosen CPUs, for instance the ones the application decodes the
+ * buffers on, so that the buffer data and metadata stay hot in their caches.
+ * A single work item processes the buffers, in completion order, and is queued
+ * on the chosen CPUs in turn.
+ */
+
+static void psee_dma_steer_work(struct work_struct *work)
+{
+	struct psee_dma *dma = container_of(work, struct psee_dma, steer.work);
+	struct psee_dma_steer *steer = &dma->steer;
+	struct psee_dma_buffer *buf;
+
+	for (;;) {
+		spin_lock_irq(&steer->lock);
+		buf = list_first_entry_or_null(&steer->bufs, struct psee_dma_buffer, queue);
+		if (buf)
+			list_del(&buf->queue);
+		spin_unlock_irq(&steer->lock);
+
+		if (!buf)
+			return;
+
+		/* The delivery paths expect the DMA callback context */
+		local_bh_disable();
+		psee_dma_complete_process(dma, buf);
+		local_bh_enable();
+
+		spin_lock_irq(&steer->lock);
+		steer->pending--;
+		spin_unlock_irq(&steer->lock);
+	}
+}
+
+/*
+ * Hand a completed buffer over to the completion CPUs. Called from the DMA
+ * callback.
+ *
+ * Return: false if the buffer is to be processed in the DMA callback
+ */
+static bool psee_dma_steer_queue(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct psee_dma_steer *steer = &dma->steer;
+	int cpu;
+
+	spin_lock(&steer->lock);
+	/* Buffers still being processed go first, whatever the CPUs now */
+	if (cpumask_empty(&steer->cpus) && !steer->pending) {
+		spin_unlock(&steer->lock);
+		return false;
+	}
+
+	list_add_tail(&buf->queue, &steer->bufs);
+	steer->pending++;
+
+	cpu = cpumask_next_and(steer->cpu, &steer->cpus, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first_and(&steer->cpus, cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = WORK_CPU_UNBOUND;
+	if (queue_work_on(cpu, system_highpri_wq, &steer->work) && cpu != WORK_CPU_UNBOUND)
+		steer->cpu = cpu;
+	spin_unlock(&steer->lock);
+
+	return true;
+}
+
+/* Bits of the V4L2_CID_XFER_COMPLETION_CPUS mask are CPU numbers */
+static int psee_dma_steer_set(struct psee_dma *dma, u32 mask)
+{
+	struct psee_dma_steer *steer = &dma->steer;
+	unsigned long bits = mask;
+	cpumask_t cpus;
+	int cpu;
+
+	cpumask_clear(&cpus);
+	for_each_set_bit(cpu, &bits, BITS_PER_TYPE(mask)) {
+		if (cpu < nr_cpu_ids)
+			cpumask_set_cpu(cpu, &cpus);
+	}
+	if (mask && !cpumask_intersects(&cpus, cpu_online_mask))
+		return -EINVAL;
+
+	/* Applied from the next completed buffer */
+	spin_lock_irq(&steer->lock);
+	cpumask_copy(&steer->cpus, &cpus);
+	spin_unlock_irq(&steer->lock);
+
+	return 0;
+}
+
+/*
+ * Packed buffers
+ *
+ * A packed capture buffer is split in packet slots of the transfer size, each
+ * filled by its own DMA transfer, so that packets stay small while the buffers
+ * go through the userspace less often. Packets are short when closed on
+ * timeout, the table of each buffer tells where they lie. The buffer completes
+ * with its last packet.
+ */
+
+/* Close a packet, must be called with queued_lock held */
+static u32 psee_dma_packet_close(struct psee_dma *dma, u32 length, u32 payload, u64 now)
+{
+	u32 reason = psee_dma_close_reason(dma, length, payload);
+
+	if (dma->adapt.target_us && psee_dma_adapt_update(&dma->adapt, payload, now))
+		psee_dma_adapt_apply(dma);
+
+	return reason;
+}
+
+/*
+ * Add a written packet to the table of its buffer, must be called with
+ * queued_lock held.
+ *
+ * Return: the reason why the packet was closed
+ */
+static u32 psee_dma_packet_record(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				  const struct dmaengine_result *result, u64 now)
+{
+	struct psee_dma_packet *packet = &buf->table[buf->packets_done];
+
+	packet->offset = buf->packets_done++ * dma->transfer_size;
+	packet->length = dma->transfer_size - result->residue;
+	packet->timestamp = now;
+	if (result->result != DMA_TRANS_NOERROR)
+		buf->packet_error = true;
+
+	return psee_dma_packet_close(dma, dma->transfer_size, packet->length, now);
+}
+
+/* End of the data of a packed buffer, must be called with queued_lock held */
+static u32 psee_dma_packets_end(struct psee_dma_buffer *buf)
+{
+	const struct psee_dma_packet *packet;
+
+	if (!buf->packets_done)
+		return 0;
+
+	packet = &buf->table[buf->packets_done - 1];
+	return packet->offset + packet->length;
+}
+
+static void psee_dma_packet_complete(void *param, const struct dmaengine_result *result)
+{
+	struct psee_dma_buffer *buf = param;
+	struct psee_dma *dma = buf->dma;
+	u64 now = ktime_get_ns();
+	u64 locked;
+
+	locked = psee_dma_queued_lock(dma);
+	psee_dma_packet_record(dma, buf, result, now);
+	psee_dma_queued_unlock(dma, locked);
+}
+
+static void psee_dma_complete(void *param, const struct dmaengine_result *result)
+{
+	struct psee_dma_buffer *buf = param;
+	struct psee_dma *dma = buf->dma;
+	struct psee_dma_done *done = &buf->done;
+	u32 payload = buf->length - result->residue;
+	u64 now = ktime_get_ns();
+	bool requeue, notify, issue;
+	struct v4l2_event event;
+	u32 reason, gap = 0;
+	u64 locked;
+
+	/*
+	 * The sequence number is taken with the buffer removal, so that the
+	 * progress peek always reports the sequence of the queue head.
+	 */
+	locked = psee_dma_queued_lock(dma);
+	WARN_ON_ONCE(psee_dma_inflight_pop(dma) != buf);
+	buf->buf.sequence = dma->sequence++;
+	if (buf->packets) {
+		reason = psee_dma_packet_record(dma, buf, result, now);
+		payload = psee_dma_packets_end(buf);
+	} else {
+		reason = psee_dma_packet_close(dma, buf->length, payload, now);
+	}
+	done->payload = payload;
+	done->failed = result->result != DMA_TRANS_NOERROR || buf->packet_error;
+	/* The transfer into the next buffer starts now */
+	done->latency_us = min_t(u64, div_u64(now - dma->active_ns, NSEC_PER_USEC), U32_MAX);
+	dma->active_ns = now;
+	done->depth = psee_dma_queue_depth(dma);
+	notify = psee_dma_watermark_update(dma, done->depth, &event);
+	if (dma->scratch.gap) {
+		dma->scratch.gap = false;
+		gap = PSEE_BUF_FLAG_GAP;
+	}
+	/* Keep the DMA running if the userspace queued no other buffer */
+	requeue = !done->depth && psee_dma_scratch_queue(dma);
+	/* Issue the buffers queued since the last issue */
+	issue = dma->unissued;
+	dma->unissued = 0;
+	psee_dma_queued_unlock(dma, locked);
+
+	if (requeue || issue)
+		dma_async_issue_pending(dma->dma);
+	if (notify)
+		v4l2_event_queue(&dma->video, &event);
+
+	buf->buf.field = V4L2_FIELD_NONE;
+	buf->buf.flags &= ~(PSEE_BUF_FLAG_CLOSE_MASK | PSEE_BUF_FLAG_GAP);
+	buf->buf.flags |= reason | gap;
+	buf->buf.vb2_buf.timestamp = now;
+
+	/* The DMA runs on, the rest may be processed on another CPU */
+	if (!psee_dma_steer_queue(dma, buf))
+		psee_dma_complete_process(dma, buf);
+}
+
+/**
+ * psee_dma_buffer_deliver - Give a completed capture buffer to its users
+ * @dma: DMA channel that filled the buffer
+ * @buf: the buffer
+ * @failed: the transfer failed
+ *
+ * The buffer goes to the completion ring, or to videobuf2 and the fan-out
+ * readers. Called once its coalescing batch is over.
+ */
+void psee_dma_buffer_deliver(struct psee_dma *dma, struct psee_dma_buffer *buf, bool failed)
+{
+	if (dma->cring.enabled) {
+		psee_dma_cring_complete(dma, buf, failed);
+		return;
+	}
+	if (!failed)
+		psee_dma_fanout_complete(dma, buf);
+	vb2_buffer_done(&buf->buf.vb2_buf, failed ? VB2_BUF_STATE_ERROR : VB2_BUF_STATE_DONE);
+}
+
+/* Output buffers are done once sent, the payload was set by the userspace */
+static void psee_dma_output_complete(void *param, const struct dmaengine_result *result)
+{
+	struct psee_dma_buffer *buf = param;
+	struct psee_dma *dma = buf->dma;
+	u64 locked;
+
+	locked = psee_dma_queued_lock(dma);
+	WARN_ON_ONCE(psee_dma_inflight_pop(dma) != buf);
+	buf->buf.sequence = dma->sequence++;
+	psee_dma_queued_unlock(dma, locked);
+
+	vb2_buffer_done(&buf->buf.vb2_buf,
+		result->result == DMA_TRANS_NOERROR ? VB2_BUF_STATE_DONE : VB2_BUF_STATE_ERROR);
+}
+
+static int
+psee_dma_queue_setup(struct vb2_queue *vq,
+		     unsigned int *nbuffers, unsigned int *nplanes,
+		     unsigned int sizes[], struct device *alloc_devs[])
+{
+	struct psee_dma *dma = vb2_get_drv_priv(vq);
+	u64 size = psee_dma_buffer_size(dma);
+	unsigned int max;
+
+	if (dma->ring_periods) {
+		if (size > UINT_MAX || vq->num_buffers)
+			return -EINVAL;
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+		/* The ring is read by the userspace without any synchronization */
+		if (vq->non_coherent_mem && !dma->coherent)
+			return -EINVAL;
+#endif
+		*nbuffers = 1;
+	}
+
+	if (dma->cring.enabled) {
+		/* Buffers go back to the DMA without videobuf2 cache maintenance */
+		if (!dma->coherent && (dma->use_sg || vq->memory != VB2_MEMORY_MMAP))
+			return -EINVAL;
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+		if (vq->non_coherent_mem && !dma->coherent)
+			return -EINVAL;
+#endif
+		/* and are mapped below the completion ring */
+		max = PSEE_DMA_CRING_OFFSET / PAGE_ALIGN(size);
+		if (vq->num_buffers >= max)
+			return -ENOMEM;
+		*nbuffers = min(*nbuffers, max - vq->num_buffers);
+	}
+
+	/* Make sure the image size is large enough. */
+	if (*nplanes)
+		return sizes[0] < size ? -EINVAL : 0;
+
+	*nplanes = 1;
+	sizes[0] = size;
+
+	return 0;
+}
+
+static int psee_dma_buffer_prepare(struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct psee_dma *dma = vb2_get_drv_priv(vb->vb2_queue);
+	struct psee_dma_buffer *buf = to_psee_dma_buffer(vbuf);
+
+	buf->dma = dma;
+
+	return 0;
+}
+
+static void psee_dma_buffer_finish(struct vb2_buffer *vb)
+{
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+	struct psee_dma_buffer *buf = to_psee_dma_buffer(to_vb2_v4l2_buffer(vb));
+
+	/* Don't let the flag set by the driver pass for a hint of userspace */
+	vb->skip_cache_sync_on_finish = buf->no_invalidate;
+#endif
+}
+
+/* The buffer is freed or its user pointer changed, its transfers go with it */
+static void psee_dma_buffer_cleanup(struct vb2_buffer *vb)
+{
+	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
+	struct psee_dma_buffer *buf = to_psee_dma_buffer(vbuf);
+	unsigned int i;
+
+	for (i = 0; i < buf->num_descs; i++)
+		dmaengine_desc_free(buf->descs[i]);
+	buf->num_descs = 0;
+}
+
+/*
+ * Cyclic ring capture
+ *
+ * Instead of a buffer per transfer, a single buffer is cyclically filled by the
+ * DMA, period by period, and never given back to userspace until the stream
+ * stops. The kernel publishes its write position in a status page following
+ * the ring, and the userspace publishes its read position in the same page.
+ */
+
+static void psee_dma_ring_period(void *param)
+{
+	struct psee_dma_buffer *buf = param;
+	struct psee_dma *dma = buf->dma;
+	struct psee_dma_ring_status *status = dma->ring_status;
+	u32 ring_size = buf->length;
+	u32 offset;
+	u64 read;
+
+	dma->ring_written += dma->transfer_size;
+	read = (u64)READ_ONCE(status->read_wrap) * ring_size +
+	       READ_ONCE(status->read_offset);
+
+	WRITE_ONCE(status->seq, ++dma->ring_seq);
+	smp_wmb();
+	status->write_wrap = div_u64_rem(dma->ring_written, ring_size, &offset);
+	status->write_offset = offset;
+	status->sequence = ++dma->sequence;
+	if (dma->ring_written - read > ring_size)
+		status->overruns = ++dma->ring_overruns;
+	status->timestamp = ktime_get_ns();
+	smp_wmb();
+	WRITE_ONCE(status->seq, ++dma->ring_seq);
+}
+
+static void psee_dma_ring_queue(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct vb2_buffer *vb = &buf->buf.vb2_buf;
+	struct dma_async_tx_descriptor *desc;
+	u32 ring_size = dma->ring_periods * dma->transfer_size;
+	void *vaddr = vb2_plane_vaddr(vb, 0);
+	u64 locked;
+
+	if (!vaddr) {
+		dev_err(dma->psee_dev->dev, "Ring buffer has no kernel mapping\n");
+		vb2_buffer_done(vb, VB2_BUF_STATE_ERROR);
+		return;
+	}
+
+	dma->ring_status = vaddr + ring_size;
+	memset(dma->ring_status, 0, sizeof(*dma->ring_status));
+	dma->ring_status->ring_size = ring_size;
+	dma->ring_status->period_size = dma->transfer_size;
+	dma->ring_written = 0;
+	dma->ring_seq = 0;
+	dma->ring_overruns = 0;
+
+	desc = dmaengine_prep_dma_cyclic(dma->dma, vb2_dma_contig_plane_dma_addr(vb, 0),
+					 ring_size, dma->transfer_size,
+					 DMA_DEV_TO_MEM, DMA_PREP_INTERRUPT);
+	if (!desc) {
+		dev_err(dma->psee_dev->dev, "Failed to prepare cyclic DMA transfer\n");
+		vb2_buffer_done(vb, VB2_BUF_STATE_ERROR);
+		return;
+	}
+	desc->callback = psee_dma_ring_period;
+	desc->callback_param = buf;
+	buf->length = ring_size;
+
+	/* Submit under the lock, so that the cookie is valid once in flight */
+	locked = psee_dma_queued_lock_irq(dma);
+	psee_dma_inflight_push(dma, buf);
+	buf->cookie = dmaengine_submit(desc);
+	psee_dma_queued_unlock_irq(dma, locked);
+
+	if (vb2_is_streaming(&dma->queue))
+		dma_async_issue_pending(dma->dma);
+}
+
+/* A ring is written period by period, every packet shall fill a period */
+static void psee_dma_ring_setup(struct psee_dma *dma)
+{
+	u32 val;
+	u64 locked;
+
+	locked = psee_dma_queued_lock_irq(dma);
+	dma->adapt.target_us = 0;
+	psee_dma_queued_unlock_irq(dma, locked);
+
+	val = read_reg(dma, REG_PACKETIZER_CONTROL);
+	write_reg(dma, REG_PACKETIZER_CONTROL, val & ~ENABLE_TLAST_TIMEOUT);
+	write_reg(dma, REG_PACKETIZER_PACKET_LENGTH, dma->transfer_size / 8);
+}
+
+/*
+ * Prepare the transfer of a buffer. Capture transfers are ended by the
+ * packetizer, output ones send the payload set by the userspace. May be called
+ * in atomic context.
+ */
+static struct dma_async_tx_descriptor *
+psee_dma_prep_transfer(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct vb2_buffer *vb = &buf->buf.vb2_buf;
+	struct dma_async_tx_descriptor *desc;
+	struct sg_table *sgt;
+	u32 flags = DMA_PREP_INTERRUPT | DMA_CTRL_ACK;
+
+	buf->packets = 0;
+	if (dma->queue.type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		buf->length = vb2_get_plane_payload(vb, 0);
+		desc = dmaengine_prep_slave_single(dma->dma,
+						   vb2_dma_contig_plane_dma_addr(vb, 0),
+						   buf->length, DMA_MEM_TO_DEV, flags);
+		if (desc)
+			desc->callback_result = psee_dma_output_complete;
+	} else if (dma->use_sg) {
+		/* The packetizer ends the transfer, the DMA may use the whole plane */
+		sgt = vb2_dma_sg_plane_desc(vb, 0);
+		buf->length = vb2_plane_size(vb, 0);
+		desc = dmaengine_prep_slave_sg(dma->dma, sgt->sgl, sgt->nents,
+					       DMA_DEV_TO_MEM, flags);
+		if (desc)
+			desc->callback_result = psee_dma_complete;
+	} else {
+		buf->length = dma->transfer_size;
+		desc = dmaengine_prep_slave_single(dma->dma,
+						   vb2_dma_contig_plane_dma_addr(vb, 0),
+						   buf->length, DMA_DEV_TO_MEM, flags);
+		if (desc)
+			desc->callback_result = psee_dma_complete;
+	}
+
+	if (desc)
+		desc->callback_param = buf;
+
+	return desc;
+}
+
+/*
+ * Prepare the transfers of a packed buffer, one per packet slot, the last one
+ * completing the buffer. The buffer gets fewer packets if the DMA engine runs
+ * out of descriptors. May be called in atomic context.
+ *
+ * Return: the number of transfers prepared in @descs
+ */
+static unsigned int psee_dma_prep_packets(struct psee_dma *dma, struct psee_dma_buffer *buf,
+					  struct dma_async_tx_descriptor **descs)
+{
+	dma_addr_t addr = vb2_dma_contig_plane_dma_addr(&buf->buf.vb2_buf, 0);
+	unsigned int i;
+
+	for (i = 0; i < dma->packets; i++) {
+		descs[i] = dmaengine_prep_slave_single(dma->dma, addr + i * dma->transfer_size,
+						       dma->transfer_size, DMA_DEV_TO_MEM,
+						       DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+		if (!descs[i])
+			break;
+		descs[i]->callback_result = psee_dma_packet_complete;
+		descs[i]->callback_param = buf;
+	}
+
+	if (i)
+		descs[i - 1]->callback_result = psee_dma_complete;
+	buf->packets = i;
+	buf->packets_done = 0;
+	buf->packet_error = false;
+	buf->length = i * dma->transfer_size;
+
+	return i;
+}
+
+/*
+ * Capture transfers only depend on the buffer and on settings frozen while
+ * buffers are allocated, so they are prepared on the first queue of a stream
+ * and then resubmitted when the DMA engine can reuse them. Imported buffers may
+ * be mapped again on each queue, their transfers are prepared each time. May be
+ * called in atomic context.
+ *
+ * Return: the number of transfers prepared in buf->descs
+ */
+static unsigned int psee_dma_prep_reusable(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	unsigned int count, i;
+
+	if (dma->packets > 1) {
+		count = psee_dma_prep_packets(dma, buf, buf->descs);
+	} else {
+		buf->descs[0] = psee_dma_prep_transfer(dma, buf);
+		count = buf->descs[0] ? 1 : 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (dmaengine_desc_set_reuse(buf->descs[i]))
+			break;
+	}
+
+	/* Without reuse, the transfers are freed once done and prepared again */
+	buf->num_descs = i == count ? count : 0;
+	return count;
+}
+
+/*
+ * Stop the DMA engine and free the reusable transfers. The engine keeps them
+ * once terminated, they are only freed on request, after its callbacks ran.
+ * The next stream prepares them again.
+ */
+static void psee_dma_terminate(struct psee_dma *dma)
+{
+	unsigned int i;
+
+	dmaengine_terminate_sync(dma->dma);
+
+	for (i = 0; i < dma->queue.num_buffers; i++)
+		psee_dma_buffer_cleanup(dma->queue.bufs[i]);
+}
+
+static void psee_dma_set_stopping(struct psee_dma *dma, bool stopping)
+{
+	u64 locked;
+
+	locked = psee_dma_queued_lock_irq(dma);
+	dma->stopping = stopping;
+	psee_dma_queued_unlock_irq(dma, locked);
+}
+
+/*
+ * Output pacing
+ *
+ * By default, output buffers are sent as fast as the pipeline accepts them. On
+ * PSEE_DMA_PACING_TIMESTAMP, each buffer is held until its timestamp, relative
+ * to the one of the first buffer, has elapsed since the first buffer was sent.
+ * A timer submits the buffers that are due, and rearms itself on the next one.
+ * Buffers that are late, or whose timestamp goes backwards, are sent at once.
+ */
+
+/* Must be called with queued_lock held */
+static u64 psee_dma_pace_due(struct psee_dma *dma, struct psee_dma_buffer *buf, u64 now)
+{
+	struct psee_dma_pace *pace = &dma->pace;
+	u64 ts = buf->buf.vb2_buf.timestamp;
+
+	if (!pace->started) {
+		pace->started = true;
+		pace->origin_ns = now;
+		pace->origin_ts = ts;
+	}
+
+	if (ts <= pace->origin_ts)
+		return pace->origin_ns;
+
+	return pace->origin_ns + (ts - pace->origin_ts);
+}
+
+static enum hrtimer_restart psee_dma_pace_timer(struct hrtimer *timer)
+{
+	struct psee_dma *dma = container_of(timer, struct psee_dma, pace.timer);
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	struct dma_async_tx_descriptor *desc;
+	struct psee_dma_buffer *buf, *nbuf;
+	u64 now = ktime_get_ns();
+	bool issue = false;
+	u64 due;
+	u64 locked;
+
+	locked = psee_dma_queued_lock(dma);
+	list_for_each_entry_safe(buf, nbuf, &dma->pace.bufs, queue) {
+		due = psee_dma_pace_due(dma, buf, now);
+		if (due > now) {
+			hrtimer_set_expires(timer, ns_to_ktime(due));
+			restart = HRTIMER_RESTART;
+			break;
+		}
+
+		list_del(&buf->queue);
+		desc = psee_dma_prep_transfer(dma, buf);
+		if (!desc) {
+			vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+			continue;
+		}
+		psee_dma_inflight_push(dma, buf);
+		buf->cookie = dmaengine_submit(desc);
+		issue = true;
+	}
+	psee_dma_queued_unlock(dma, locked);
+
+	if (issue)
+		dma_async_issue_pending(dma->dma);
+
+	return restart;
+}
+
+/* Run the timer now, it rearms itself as long as buffers wait */
+static void psee_dma_pace_kick(struct psee_dma *dma)
+{
+	hrtimer_start(&dma->pace.timer, 0, HRTIMER_MODE_REL_SOFT);
+}
+
+static void psee_dma_pace_queue(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	bool first;
+	u64 locked;
+
+	locked = psee_dma_queued_lock_irq(dma);
+	first = list_empty(&dma->pace.bufs);
+	list_add_tail(&buf->queue, &dma->pace.bufs);
+	psee_dma_queued_unlock_irq(dma, locked);
+
+	if (first && vb2_is_streaming(&dma->queue))
+		psee_dma_pace_kick(dma);
+}
+
+/*
+ * Hand a buffer to the DMA engine. Also called from the completion path, when
+ * the fan-out readers release a buffer the owner already queued back, or the
+ * completion ring users submit it back. Once the stream is stopping, the DMA
+ * engine is terminated and the buffer goes back to videobuf2 instead.
+ */
+void psee_dma_submit(struct psee_dma *dma, struct psee_dma_buffer *buf)
+{
+	struct dma_async_tx_descriptor *prepared[PSEE_DMA_MAX_PACKETS];
+	struct dma_async_tx_descriptor **descs = prepared;
+	struct vb2_buffer *vb = &buf->buf.vb2_buf;
+	bool notify = false, issue = false;
+	unsigned int count = 1, depth, i;
+	struct v4l2_event event;
+	unsigned long flags;
+	u64 locked;
+
+	if (READ_ONCE(dma->stopping)) {
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+		return;
+	}
+
+	if (buf->num_descs) {
+		/* Prepared earlier in the stream, only the packets table starts over */
+		descs = buf->descs;
+		count = buf->num_descs;
+		buf->packets_done = 0;
+		buf->packet_error = false;
+	} else if (dma->desc_reuse && vb->memory != VB2_MEMORY_DMABUF) {
+		descs = buf->descs;
+		count = psee_dma_prep_reusable(dma, buf);
+	} else if (dma->packets > 1) {
+		count = psee_dma_prep_packets(dma, buf, descs);
+	} else {
+		descs[0] = psee_dma_prep_transfer(dma, buf);
+	}
+	if (!count || !descs[0]) {
+		dev_err(dma->psee_dev->dev, "Failed to prepare DMA transfer\n");
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+		return;
+	}
 
-	buf->dma = dma;
+	/* Submit under the lock, so that the cookie is valid once in flight */
+	local_irq_save(flags);
+	locked = psee_dma_queued_lock(dma);
+	/*
+	 * Stopping meanwhile: the transfers are not submitted, reusable ones are
+	 * freed with the buffer, the others when the channel is terminated again.
+	 */
+	if (dma->stopping) {
+		psee_dma_queued_unlock(dma, locked);
+		local_irq_restore(flags);
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+		return;
+	}
+	/* A transfer into an empty queue starts with the buffer */
+	if (!psee_dma_queue_depth(dma) && !dma->scratch.active)
+		dma->active_ns = ktime_get_ns();
+	psee_dma_inflight_push(dma, buf);
+	/* The cookie of the last packet tells when the buffer is over */
+	for (i = 0; i < count; i++)
+		buf->cookie = dmaengine_submit(descs[i]);
+	if (vb2_is_streaming(&dma->queue)) {
+		depth = psee_dma_queue_depth(dma);
+		notify = psee_dma_watermark_update(dma, depth, &event);
+		/*
+		 * Batch back-to-back queues: while enough issued buffers are
+		 * ahead of the DMA, the next completion issues this one.
+		 */
+		if (depth - 1 - dma->unissued >= PSEE_DMA_ISSUE_AHEAD) {
+			dma->unissued++;
+		} else {
+			dma->unissued = 0;
+			issue = true;
+		}
+	}
+	psee_dma_queued_unlock(dma, locked);
+	local_irq_restore(flags);
 
-	return 0;
+	if (issue)
+		dma_async_issue_pending(dma->dma);
+	if (notify)
+		v4l2_event_queue(&dma->video, &event);
 }
 
 static void psee_dma_buffer_queue(struct vb2_buffer *vb)
@@ -384,40 +2077,30 @@ static void psee_dma_buffer_queue(struct vb2_buffer *vb)
 	struct vb2_v4l2_buffer *vbuf = to_vb2_v4l2_buffer(vb);
 	struct psee_dma *dma = vb2_get_drv_priv(vb->vb2_queue);
 	struct psee_dma_buffer *buf = to_psee_dma_buffer(vbuf);
-	struct dma_async_tx_descriptor *desc;
-	enum dma_transfer_direction dir;
-	dma_addr_t addr = vb2_dma_contig_plane_dma_addr(vb, 0);
-	size_t size;
-	u32 flags;
-
-	if (dma->queue.type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
-		flags = DMA_PREP_INTERRUPT | DMA_CTRL_ACK;
-		dir = DMA_DEV_TO_MEM;
-	} else {
-		flags = DMA_PREP_INTERRUPT | DMA_CTRL_ACK;
-		dir = DMA_MEM_TO_DEV;
-	}
 
-	//size = vb2_plane_size(vb, 0);
-	size = dma->transfer_size;
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+	/*
+	 * The hint of this VIDIOC_QBUF. Kept for the whole stream: with the
+	 * completion ring, the buffer is not queued again.
+	 */
+	buf->no_invalidate = vb->skip_cache_sync_on_finish;
+#endif
 
-	desc = dmaengine_prep_slave_single(dma->dma, addr, size, dir, flags);
-	if (!desc) {
-		dev_err(dma->psee_dev->dev, "Failed to prepare DMA transfer\n");
-		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+	if (dma->ring_periods) {
+		psee_dma_ring_queue(dma, buf);
 		return;
 	}
-	desc->callback_result = psee_dma_complete;
-	desc->callback_param = buf;
 
-	spin_lock_irq(&dma->queued_lock);
-	list_add_tail(&buf->queue, &dma->queued_bufs);
-	spin_unlock_irq(&dma->queued_lock);
+	if (dma->pacing == PSEE_DMA_PACING_TIMESTAMP) {
+		psee_dma_pace_queue(dma, buf);
+		return;
+	}
 
-	dmaengine_submit(desc);
+	/* Fan-out readers still use the buffer, it is submitted on release */
+	if (psee_dma_fanout_park(dma, buf))
+		return;
 
-	if (vb2_is_streaming(&dma->queue))
-		dma_async_issue_pending(dma->dma);
+	psee_dma_submit(dma, buf);
 }
 
 static int psee_dma_start_streaming(struct vb2_queue *vq, unsigned int count)
@@ -425,9 +2108,17 @@ static int psee_dma_start_streaming(struct vb2_queue *vq, unsigned int count)
 	struct psee_dma *dma = vb2_get_drv_priv(vq);
 	struct psee_dma_buffer *buf, *nbuf;
 	struct psee_pipeline *pipe;
+	struct v4l2_event event;
+	bool notify = false;
 	int ret;
+	u64 locked;
 
 	dma->sequence = 0;
+	memset(&dma->stats, 0, sizeof(dma->stats));
+	memset(&dma->decoder, 0, sizeof(dma->decoder));
+	locked = psee_dma_queued_lock_irq(dma);
+	dma->pace.started = false;
+	psee_dma_queued_unlock_irq(dma, locked);
 
 	/*
 	 * Start streaming on the pipeline. No link touching an entity in the
@@ -449,35 +2140,89 @@ static int psee_dma_start_streaming(struct vb2_queue *vq, unsigned int count)
 	ret = psee_dma_verify_format(dma);
 	if (ret < 0)
 		goto error_stop;
+	dma->code = psee_dma_remote_code(dma);
+	dma->csi2 = psee_dma_find_csi2(dma);
+	if (vq->type == V4L2_BUF_TYPE_VIDEO_CAPTURE && !dma->ring_periods)
+		psee_dma_scratch_attach(dma);
 
 	ret = psee_pipeline_prepare(pipe, dma);
 	if (ret < 0)
 		goto error_stop;
 
+	psee_dma_cring_start(dma);
+	psee_dma_coalesce_start(dma);
+
 	/* Start the DMA engine. This must be done before starting the blocks
 	 * in the pipeline to avoid DMA synchronization issues.
 	 */
+	locked = psee_dma_queued_lock_irq(dma);
+	dma->active_ns = ktime_get_ns();
+	dma->unissued = 0;
+	psee_dma_queued_unlock_irq(dma, locked);
 	dma_async_issue_pending(dma->dma);
+	if (dma->pacing == PSEE_DMA_PACING_TIMESTAMP)
+		psee_dma_pace_kick(dma);
 
 	/* Set the packetizer requested behavior */
 	v4l2_ctrl_handler_setup(dma->video.ctrl_handler);
 
-	/* Start the pipeline. */
-	psee_pipeline_set_stream(pipe, true);
+	/* Tell right away if the stream starts with too few buffers */
+	if (!dma->ring_periods) {
+		locked = psee_dma_queued_lock_irq(dma);
+		dma->queue_low = false;
+		notify = psee_dma_watermark_update(dma, psee_dma_queue_depth(dma), &event);
+		psee_dma_queued_unlock_irq(dma, locked);
+		if (notify)
+			v4l2_event_queue(&dma->video, &event);
+	}
+	if (PACKETIZER_VERSION_IS_V2(dma->version))
+		psee_dma_setup_filler(dma, dma->code);
+	if (dma->ring_periods)
+		psee_dma_ring_setup(dma);
+
+	if (vq->type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		psee_dma_fanout_start(dma);
+
+	/* Start the branch of the pipeline feeding this DMA. */
+	ret = psee_graph_pipeline_start_stop(dma->psee_dev, dma, true);
+	if (ret < 0)
+		goto error_terminate;
+
+	psee_dma_flush_enable(dma, true);
 
 	return 0;
 
+error_terminate:
+	if (dma->iomem)
+		write_reg(dma, REG_PACKETIZER_CONTROL, CLEAR);
+	hrtimer_cancel(&dma->pace.timer);
+	psee_dma_set_stopping(dma, true);
+	psee_dma_fanout_stop(dma);
+	psee_dma_scratch_detach(dma);
+	psee_dma_terminate(dma);
+	flush_work(&dma->steer.work);
+	psee_dma_coalesce_stop(dma);
+	psee_dma_cring_stop(dma);
+	psee_pipeline_cleanup(pipe);
+	dma->csi2 = NULL;
+	media_pipeline_stop(&dma->video.entity);
+	goto error;
+
 error_stop:
+	psee_dma_scratch_detach(dma);
 	media_pipeline_stop(&dma->video.entity);
 
 error:
 	/* Give back all queued buffers to videobuf2. */
-	spin_lock_irq(&dma->queued_lock);
-	list_for_each_entry_safe(buf, nbuf, &dma->queued_bufs, queue) {
+	locked = psee_dma_queued_lock_irq(dma);
+	while ((buf = psee_dma_inflight_pop(dma)))
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_QUEUED);
+	list_for_each_entry_safe(buf, nbuf, &dma->pace.bufs, queue) {
 		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_QUEUED);
 		list_del(&buf->queue);
 	}
-	spin_unlock_irq(&dma->queued_lock);
+	dma->stopping = false;
+	psee_dma_queued_unlock_irq(dma, locked);
 
 	return ret;
 }
@@ -487,32 +2232,69 @@ static void psee_dma_stop_streaming(struct vb2_queue *vq)
 	struct psee_dma *dma = vb2_get_drv_priv(vq);
 	struct psee_pipeline *pipe = to_psee_pipeline(&dma->video.entity);
 	struct psee_dma_buffer *buf, *nbuf;
+	u64 locked;
+
+	/* Restore the settings a flush may have changed */
+	psee_dma_flush_enable(dma, false);
 
-	/* Stop the pipeline. */
-	psee_pipeline_set_stream(pipe, false);
+	/* Stop the branch of the pipeline feeding this DMA. */
+	psee_graph_pipeline_start_stop(dma->psee_dev, dma, false);
 
 	/* Disable packetizer and clear its memories */
-	write_reg(dma, REG_PACKETIZER_CONTROL, CLEAR);
+	if (dma->iomem)
+		write_reg(dma, REG_PACKETIZER_CONTROL, CLEAR);
 
-	/* Stop and reset the DMA engine. */
-	dmaengine_terminate_all(dma->dma);
+	/* Hold the buffers still waiting for their time */
+	hrtimer_cancel(&dma->pace.timer);
+
+	/*
+	 * Stop and reset the DMA engine. The buffers delivered from now on may
+	 * be given back by their users, they must not restart it.
+	 */
+	psee_dma_set_stopping(dma, true);
+
+	/*
+	 * Readers lose their buffers, the parked ones are given back, and the
+	 * buffers completed from now on are not given to the readers anymore.
+	 */
+	psee_dma_fanout_stop(dma);
+
+	psee_dma_scratch_detach(dma);
+	psee_dma_terminate(dma);
+
+	/* The completed buffers are processed, the last batch is lost with them */
+	flush_work(&dma->steer.work);
+	psee_dma_coalesce_stop(dma);
+
+	/* The buffers held by the completion ring users are given back */
+	psee_dma_cring_stop(dma);
 
 	/* Cleanup the pipeline and mark it as being stopped. */
 	psee_pipeline_cleanup(pipe);
 	media_pipeline_stop(&dma->video.entity);
+	dma->csi2 = NULL;
 
-	/* Give back all queued buffers to videobuf2. */
-	spin_lock_irq(&dma->queued_lock);
-	list_for_each_entry_safe(buf, nbuf, &dma->queued_bufs, queue) {
+	/*
+	 * Give back all queued buffers to videobuf2. The data received by the
+	 * head buffer is lost: videobuf2 discards the buffers done from here.
+	 */
+	locked = psee_dma_queued_lock_irq(dma);
+	while ((buf = psee_dma_inflight_pop(dma)))
 		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
+	list_for_each_entry_safe(buf, nbuf, &dma->pace.bufs, queue) {
 		list_del(&buf->queue);
+		vb2_buffer_done(&buf->buf.vb2_buf, VB2_BUF_STATE_ERROR);
 	}
-	spin_unlock_irq(&dma->queued_lock);
+	/* videobuf2 queues the buffers of the next stream before starting it */
+	dma->stopping = false;
+	psee_dma_queued_unlock_irq(dma, locked);
 }
 
 static const struct vb2_ops psee_dma_queue_qops = {
 	.queue_setup = psee_dma_queue_setup,
 	.buf_prepare = psee_dma_buffer_prepare,
+	.buf_finish = psee_dma_buffer_finish,
+	.buf_cleanup = psee_dma_buffer_cleanup,
 	.buf_queue = psee_dma_buffer_queue,
 	.wait_prepare = vb2_ops_wait_prepare,
 	.wait_finish = vb2_ops_wait_finish,
@@ -575,7 +2357,7 @@ __psee_dma_get_format(struct psee_dma *dma, struct v4l2_pix_format *pix)
 	v4l2_fill_pix_format(pix, &fmt.format);
 
 	/* The packetizer uses arbitrary transfer size */
-	pix->sizeimage = dma->transfer_size;
+	pix->sizeimage = psee_dma_sizeimage(dma, dma->transfer_size);
 	/* and there is no per line padding, there isn't even lines */
 	pix->bytesperline = 0;
 	return 0;
@@ -613,8 +2395,17 @@ psee_dma_try_format(struct file *file, void *fh, struct v4l2_format *format)
 {
 	struct v4l2_fh *vfh = file->private_data;
 	struct psee_dma *dma = to_psee_dma(vfh->vdev);
+	u32 transfer_size = psee_dma_sizeimage_request(dma, format->fmt.pix.sizeimage);
+	int ret;
 
-	return __psee_dma_get_format(dma, &format->fmt.pix);
+	ret = __psee_dma_get_format(dma, &format->fmt.pix);
+	if (ret < 0)
+		return ret;
+
+	if (transfer_size)
+		format->fmt.pix.sizeimage = psee_dma_sizeimage(dma, transfer_size);
+
+	return 0;
 }
 
 static int
@@ -622,14 +2413,27 @@ psee_dma_set_format(struct file *file, void *fh, struct v4l2_format *format)
 {
 	struct v4l2_fh *vfh = file->private_data;
 	struct psee_dma *dma = to_psee_dma(vfh->vdev);
+	u32 transfer_size = psee_dma_sizeimage_request(dma, format->fmt.pix.sizeimage);
+	int ret;
 
 	if (vb2_is_busy(&dma->queue))
 		return -EBUSY;
 
 	/* Make sure counter pattern is disabled */
-	write_reg(dma, REG_PACKETIZER_CONTROL, 0);
-	/* Set packet size to image size in bus words */
-	write_reg(dma, REG_PACKETIZER_PACKET_LENGTH, dma->transfer_size / 8);
+	if (dma->iomem)
+		write_reg(dma, REG_PACKETIZER_CONTROL, 0);
+
+	/* A transfer size request goes through the control to keep both views
+	 * consistent, and programs the packet length
+	 */
+	if (transfer_size) {
+		ret = v4l2_ctrl_s_ctrl(dma->xfer_size, transfer_size);
+		if (ret < 0)
+			return ret;
+	} else if (dma->iomem) {
+		/* Set packet size to image size in bus words */
+		write_reg(dma, REG_PACKETIZER_PACKET_LENGTH, dma->transfer_size / 8);
+	}
 
 	return __psee_dma_get_format(dma, &format->fmt.pix);
 }
@@ -685,12 +2489,193 @@ static int psee_dma_g_chip_info(struct file *file, void *fh, struct v4l2_dbg_chi
 }
 #endif
 
+static int psee_dma_log_status(struct file *file, void *fh)
+{
+	struct psee_dma *dma = video_drvdata(file);
+	struct device *dev = dma->psee_dev->dev;
+	struct psee_dma_stats stats;
+	u32 closed, batches;
+	const char *unit;
+	u64 batched;
+
+	/* Reading the statistics is not accounted in them */
+	spin_lock_irq(&dma->queued_lock);
+	stats = dma->stats;
+	spin_unlock_irq(&dma->queued_lock);
+
+	/* Packed buffers are accounted packet by packet */
+	unit = dma->packets > 1 ? "packets" : "buffers";
+	closed = stats.full + stats.timeout + stats.flush;
+	dev_info(dev, "%s: %s closed full: %u, on timeout: %u, on flush: %u\n",
+		 dma->video.name, unit, stats.full, stats.timeout, stats.flush);
+	if (stats.flush_lapsed || stats.flush_restore_failed)
+		dev_info(dev, "%s: flushes closing no packet: %u, not restored: %u\n",
+			 dma->video.name, stats.flush_lapsed, stats.flush_restore_failed);
+	dev_info(dev, "%s: longest run of full %s: %u\n",
+		 dma->video.name, unit, stats.max_full_run);
+	if (closed)
+		dev_info(dev, "%s: average payload: %llu bytes\n",
+			 dma->video.name, div_u64(stats.bytes, closed));
+	if (stats.dropped)
+		dev_info(dev, "%s: dropped while no buffer was queued: %u packets, %llu bytes\n",
+			 dma->video.name, stats.dropped, stats.dropped_bytes);
+	spin_lock_irq(&dma->coalesce.lock);
+	batches = dma->coalesce.batches;
+	batched = dma->coalesce.batched;
+	spin_unlock_irq(&dma->coalesce.lock);
+	if (batches)
+		dev_info(dev, "%s: coalesced batches: %u, %llu buffers\n",
+			 dma->video.name, batches, batched);
+	dev_info(dev, "%s: queue lock taken: %u, contended: %u\n",
+		 dma->video.name, stats.lock_taken, stats.lock_contended);
+	if (IS_ENABLED(CONFIG_VIDEO_ADV_DEBUG) && stats.lock_taken)
+		dev_info(dev, "%s: queue lock held: %llu ns average, %llu ns max\n",
+			 dma->video.name, div_u64(stats.lock_hold_ns, stats.lock_taken),
+			 stats.lock_max_hold_ns);
+	if (dma->cring.enabled)
+		dev_info(dev, "%s: completion ring submissions rejected: %u\n",
+			 dma->video.name, READ_ONCE(dma->cring.rejected));
+
+	return v4l2_ctrl_log_status(file, fh);
+}
+
+static int psee_dma_g_progress(struct psee_dma *dma, struct psee_dma_progress *progress)
+{
+	struct psee_dma_buffer *buf;
+	struct dma_slave_caps caps;
+	struct dma_tx_state state;
+	enum dma_status status;
+	u64 locked;
+
+	/* The ring status page already tells the progress, period by period */
+	if (dma->ring_periods)
+		return -ENOTTY;
+
+	memset(progress, 0, sizeof(*progress));
+	/* Packed buffers progress by packets, each one a transfer */
+	if (dma->packets > 1)
+		progress->granularity = DMA_RESIDUE_GRANULARITY_DESCRIPTOR;
+	else if (!dma_get_slave_caps(dma->dma, &caps))
+		progress->granularity = caps.residue_granularity;
+
+	/*
+	 * Hold the queue lock, so that the head buffer can not be completed and
+	 * requeued behind our back: its cookie and sequence stay consistent.
+	 */
+	locked = psee_dma_queued_lock_irq(dma);
+	buf = psee_dma_inflight_peek(dma);
+	if (!buf) {
+		psee_dma_queued_unlock_irq(dma, locked);
+		return -ENODATA;
+	}
+
+	status = dmaengine_tx_status(dma->dma, buf->cookie, &state);
+	progress->index = buf->buf.vb2_buf.index;
+	progress->sequence = dma->sequence;
+	progress->length = buf->length;
+	if (status == DMA_COMPLETE)
+		/* The payload is only known when the buffer is dequeued */
+		progress->flags |= PSEE_DMA_PROGRESS_DONE;
+	else if (status == DMA_ERROR)
+		progress->flags |= PSEE_DMA_PROGRESS_ERROR;
+	else if (buf->packets)
+		/* Each packet is a transfer, only the completed ones count */
+		progress->bytes = psee_dma_packets_end(buf);
+	else if (!dma->scratch.active && state.residue <= buf->length)
+		progress->bytes = buf->length - state.residue;
+	psee_dma_queued_unlock_irq(dma, locked);
+
+	return 0;
+}
+
+static int psee_dma_g_bufinfo(struct psee_dma *dma, struct psee_dma_buffer_info *info)
+{
+	struct psee_dma_buffer *buf;
+	struct vb2_buffer *vb;
+
+	if (info->index >= dma->queue.num_buffers)
+		return -EINVAL;
+
+	/* The info is rewritten when the buffer completes again */
+	vb = dma->queue.bufs[info->index];
+	if (vb->state != VB2_BUF_STATE_DEQUEUED)
+		return -EBUSY;
+
+	buf = to_psee_dma_buffer(to_vb2_v4l2_buffer(vb));
+	*info = buf->info;
+	info->index = vb->index;
+	return 0;
+}
+
+/* The table of the buffer being filled grows as its packets complete */
+static int psee_dma_g_packets(struct psee_dma *dma, struct psee_dma_packets *packets)
+{
+	struct psee_dma_buffer *buf;
+	u64 locked;
+
+	if (dma->packets < 2)
+		return -ENOTTY;
+	if (packets->index >= dma->queue.num_buffers)
+		return -EINVAL;
+
+	buf = to_psee_dma_buffer(to_vb2_v4l2_buffer(dma->queue.bufs[packets->index]));
+	memset(packets->reserved, 0, sizeof(packets->reserved));
+	locked = psee_dma_queued_lock_irq(dma);
+	packets->count = buf->packets_done;
+	memcpy(packets->packets, buf->table, buf->packets_done * sizeof(buf->table[0]));
+	psee_dma_queued_unlock_irq(dma, locked);
+	memset(&packets->packets[packets->count], 0,
+	       (PSEE_DMA_MAX_PACKETS - packets->count) * sizeof(packets->packets[0]));
+
+	return 0;
+}
+
+static int psee_dma_subscribe_event(struct v4l2_fh *fh,
+				    const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_PSEE_QUEUE_LOW:
+	case V4L2_EVENT_PSEE_QUEUE_RECOVERED:
+		return v4l2_event_subscribe(fh, sub, 4, NULL);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
+static long psee_dma_ioctl_default(struct file *file, void *fh, bool valid_prio,
+				   unsigned int cmd, void *arg)
+{
+	struct psee_dma *dma = video_drvdata(file);
+
+	switch (cmd) {
+	case PSEE_DMA_IOC_G_PROGRESS:
+		return psee_dma_g_progress(dma, arg);
+	case PSEE_DMA_IOC_G_BUFINFO:
+		return psee_dma_g_bufinfo(dma, arg);
+	case PSEE_DMA_IOC_G_PACKETS:
+		return psee_dma_g_packets(dma, arg);
+	case PSEE_DMA_IOC_CRING_KICK:
+		return psee_dma_cring_kick(dma);
+	case PSEE_DMA_IOC_FANOUT_ATTACH:
+	case PSEE_DMA_IOC_FANOUT_DETACH:
+	case PSEE_DMA_IOC_FANOUT_DQBUF:
+	case PSEE_DMA_IOC_FANOUT_QBUF:
+		return psee_dma_fanout_ioctl(dma, to_psee_dma_fh(fh), file, cmd, arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
 static const struct v4l2_ioctl_ops psee_dma_ioctl_ops = {
 	.vidioc_querycap		= psee_dma_querycap,
 	.vidioc_enum_fmt_vid_cap	= psee_dma_enum_format,
 	.vidioc_g_fmt_vid_cap		= psee_dma_get_format,
 	.vidioc_s_fmt_vid_cap		= psee_dma_set_format,
 	.vidioc_try_fmt_vid_cap		= psee_dma_try_format,
+	.vidioc_enum_fmt_vid_out	= psee_dma_enum_format,
+	.vidioc_g_fmt_vid_out		= psee_dma_get_format,
+	.vidioc_s_fmt_vid_out		= psee_dma_set_format,
+	.vidioc_try_fmt_vid_out		= psee_dma_try_format,
 	.vidioc_reqbufs			= vb2_ioctl_reqbufs,
 	.vidioc_querybuf		= vb2_ioctl_querybuf,
 	.vidioc_qbuf			= vb2_ioctl_qbuf,
@@ -699,6 +2684,10 @@ static const struct v4l2_ioctl_ops psee_dma_ioctl_ops = {
 	.vidioc_expbuf			= vb2_ioctl_expbuf,
 	.vidioc_streamon		= vb2_ioctl_streamon,
 	.vidioc_streamoff		= vb2_ioctl_streamoff,
+	.vidioc_log_status		= psee_dma_log_status,
+	.vidioc_subscribe_event		= psee_dma_subscribe_event,
+	.vidioc_unsubscribe_event	= v4l2_event_unsubscribe,
+	.vidioc_default			= psee_dma_ioctl_default,
 #ifdef CONFIG_VIDEO_ADV_DEBUG
 	.vidioc_g_register		= psee_dma_g_register,
 	.vidioc_s_register		= psee_dma_s_register,
@@ -710,41 +2699,235 @@ static const struct v4l2_ioctl_ops psee_dma_ioctl_ops = {
  * V4L2 file operations
  */
 
+/* As v4l2_fh_open(), with room for the fan-out reader state */
+static int psee_dma_open(struct file *file)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct psee_dma_fh *fh;
+
+	fh = kzalloc(sizeof(*fh), GFP_KERNEL);
+	if (!fh)
+		return -ENOMEM;
+
+	v4l2_fh_init(&fh->fh, vdev);
+	INIT_LIST_HEAD(&fh->reader.list);
+	init_waitqueue_head(&fh->reader.wait);
+	file->private_data = &fh->fh;
+	v4l2_fh_add(&fh->fh);
+
+	return 0;
+}
+
+static int psee_dma_release(struct file *file)
+{
+	struct psee_dma *dma = video_drvdata(file);
+
+	mutex_lock(&dma->lock);
+	psee_dma_fanout_release(dma, to_psee_dma_fh(file->private_data));
+	mutex_unlock(&dma->lock);
+
+	/* Frees the file handle, the v4l2_fh is at its start */
+	return vb2_fop_release(file);
+}
+
+static __poll_t psee_dma_poll(struct file *file, poll_table *wait)
+{
+	struct psee_dma *dma = video_drvdata(file);
+	struct psee_dma_fh *fh = to_psee_dma_fh(file->private_data);
+
+	/* Buffers complete in the completion ring, not in videobuf2 */
+	if (dma->cring.enabled)
+		return psee_dma_cring_poll(dma, &fh->fh, file, wait);
+
+	/* Readers wait for their own buffers, not for the queue ones */
+	if (READ_ONCE(fh->reader.attached))
+		return psee_dma_fanout_poll(dma, fh, file, wait);
+
+	return vb2_fop_poll(file, wait);
+}
+
+static int psee_dma_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct psee_dma *dma = video_drvdata(file);
+
+	/* Without the completion ring, buffers may be mapped at its offset */
+	if (dma->cring.enabled && vma->vm_pgoff == PSEE_DMA_CRING_OFFSET >> PAGE_SHIFT)
+		return psee_dma_cring_mmap(dma, vma);
+
+	return vb2_fop_mmap(file, vma);
+}
+
 static const struct v4l2_file_operations psee_dma_fops = {
 	.owner		= THIS_MODULE,
 	.unlocked_ioctl	= video_ioctl2,
-	.open		= v4l2_fh_open,
-	.release	= vb2_fop_release,
-	.poll		= vb2_fop_poll,
-	.mmap		= vb2_fop_mmap,
+	.open		= psee_dma_open,
+	.release	= psee_dma_release,
+	.poll		= psee_dma_poll,
+	.mmap		= psee_dma_mmap,
 };
 
 /* -----------------------------------------------------------------------------
  * DMA Packetizer controls
  */
-static int timeout_s_ctrl(struct v4l2_ctrl *ctrl)
+
+static int packetizer_s_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct psee_dma *dma = ctrl->priv;
 	u32 val;
+	u64 locked;
 
 	switch (ctrl->id) {
+	case V4L2_CID_XFER_PACKET_LENGTH:
+		/* Buffers are allocated with the transfer size, keep it while they live */
+		if (ctrl->val != dma->transfer_size && vb2_is_busy(&dma->queue))
+			return -EBUSY;
+		dma->transfer_size = ctrl->val;
+		/* Set packet size to image size in bus words */
+		if (!dma->iomem)
+			return 0;
+		if (!dma->adapt.target_us)
+			write_reg(dma, REG_PACKETIZER_PACKET_LENGTH, dma->transfer_size / 8);
+		else
+			dma->adapt.max_length = dma->transfer_size;
+		return 0;
+	case V4L2_CID_XFER_RING_PERIODS:
+		/* The cyclic DMA needs a contiguous ring of at least 2 periods */
+		if (ctrl->val == 1 || (ctrl->val && dma->use_sg))
+			return -EINVAL;
+		if (ctrl->val != dma->ring_periods && vb2_is_busy(&dma->queue))
+			return -EBUSY;
+		/* A ring can't be packed, nor completed buffer by buffer */
+		if (ctrl->val && (dma->packets > 1 || dma->cring.enabled))
+			return -EBUSY;
+		dma->ring_periods = ctrl->val;
+		return 0;
+	case V4L2_CID_XFER_PACKETS:
+		/* Packet slots are laid out in contiguous buffers only */
+		if (ctrl->val > 1 && dma->use_sg)
+			return -EINVAL;
+		if (ctrl->val != dma->packets && vb2_is_busy(&dma->queue))
+			return -EBUSY;
+		if (ctrl->val > 1 && dma->ring_periods)
+			return -EBUSY;
+		dma->packets = ctrl->val;
+		return 0;
+	case V4L2_CID_XFER_COMPLETION_RING:
+		if (ctrl->val == dma->cring.enabled)
+			return 0;
+		if (vb2_is_busy(&dma->queue))
+			return -EBUSY;
+		if (ctrl->val && dma->ring_periods)
+			return -EBUSY;
+		return psee_dma_cring_enable(dma, ctrl->val);
 	case V4L2_CID_XFER_TIMEOUT_ENABLE:
+		/* A short packet would break the layout of the ring */
+		if (dma->ring_periods && vb2_is_streaming(&dma->queue))
+			return -EBUSY;
+		/* The flush would restore the setting it found */
+		locked = psee_dma_queued_lock_irq(dma);
+		psee_dma_flush_end(dma);
 		val = read_reg(dma, REG_PACKETIZER_CONTROL);
 		val &= ~ENABLE_TLAST_TIMEOUT;
 		val |= (ctrl->val ? ENABLE_TLAST_TIMEOUT : 0);
 		write_reg(dma, REG_PACKETIZER_CONTROL, val);
+		psee_dma_queued_unlock_irq(dma, locked);
+		return 0;
+	case V4L2_CID_XFER_TIMEOUT:
+		locked = psee_dma_queued_lock_irq(dma);
+		psee_dma_flush_end(dma);
+		/* The adaptive packetization owns the timeout while enabled */
+		if (!dma->adapt.target_us)
+			write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT,
+				  psee_dma_us_to_cycles(dma, ctrl->val));
+		psee_dma_queued_unlock_irq(dma, locked);
+		return 0;
+	case V4L2_CID_XFER_FLUSH:
+		/* A short packet would break the layout of the ring */
+		if (dma->ring_periods)
+			return -EBUSY;
+		psee_dma_flush_request(dma);
+		return 0;
+	case V4L2_CID_XFER_LATENCY_TARGET:
+		/* Neither can the ring packets be shortened */
+		if (dma->ring_periods && vb2_is_streaming(&dma->queue))
+			return -EBUSY;
+		locked = psee_dma_queued_lock_irq(dma);
+		psee_dma_flush_end(dma);
+		psee_dma_adapt_reset(&dma->adapt, ctrl->val,
+				     dma->xfer_timeout->minimum, dma->transfer_size);
+		if (ctrl->val) {
+			psee_dma_adapt_apply(dma);
+		} else {
+			/* Get back to the user settings */
+			write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT,
+				  psee_dma_us_to_cycles(dma, dma->xfer_timeout->val));
+			write_reg(dma, REG_PACKETIZER_PACKET_LENGTH,
+				  dma->transfer_size / 8);
+		}
+		psee_dma_queued_unlock_irq(dma, locked);
+		return 0;
+	case V4L2_CID_XFER_STRIP_FILLER:
+		dma->strip_filler = ctrl->val;
+		return 0;
+	case V4L2_CID_XFER_DECODER_STATE:
+		dma->track_decoder = ctrl->val;
+		return 0;
+	case V4L2_CID_XFER_CLOCK:
+		/* The fit is done against the clock, keep it while streaming */
+		if (ctrl->val != dma->clock && vb2_is_streaming(&dma->queue))
+			return -EBUSY;
+		dma->clock = ctrl->val;
+		return 0;
+	case V4L2_CID_XFER_PACING:
+		/* Buffers are queued differently, keep it while they live */
+		if (ctrl->val != dma->pacing && vb2_is_busy(&dma->queue))
+			return -EBUSY;
+		dma->pacing = ctrl->val;
+		return 0;
+	case V4L2_CID_XFER_COMPLETION_CPUS:
+		return psee_dma_steer_set(dma, ctrl->val);
+	case V4L2_CID_XFER_COALESCING:
+		psee_dma_coalesce_set_mode(dma, ctrl->val);
+		return 0;
+	case V4L2_CID_XFER_COALESCE_BUFFERS:
+		spin_lock_irq(&dma->coalesce.lock);
+		dma->coalesce.buffers = ctrl->val;
+		spin_unlock_irq(&dma->coalesce.lock);
+		return 0;
+	case V4L2_CID_XFER_COALESCE_DELAY:
+		/* The batch waiting already keeps its deadline */
+		spin_lock_irq(&dma->coalesce.lock);
+		dma->coalesce.delay_us = ctrl->val;
+		spin_unlock_irq(&dma->coalesce.lock);
+		return 0;
+	case V4L2_CID_XFER_WATERMARK:
+		/* Applied from the next queued or completed buffer */
+		locked = psee_dma_queued_lock_irq(dma);
+		dma->watermark = ctrl->val;
+		psee_dma_queued_unlock_irq(dma, locked);
 		return 0;
 	default:
 		return -EINVAL;
 	}
 }
 
-static const struct v4l2_ctrl_ops timeout_ctrl_ops = {
-	.s_ctrl = timeout_s_ctrl,
+static const struct v4l2_ctrl_ops packetizer_ctrl_ops = {
+	.s_ctrl = packetizer_s_ctrl,
+};
+
+static const struct v4l2_ctrl_config packet_length_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_PACKET_LENGTH,
+	.name = "Transfer size",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = PSEE_DMA_MIN_TRANSFER_SIZE,
+	.max = PSEE_DMA_MAX_TRANSFER_SIZE,
+	.def = DEFAULT_PACKET_LENGTH,
+	.step = PAGE_SIZE,
 };
 
 static const struct v4l2_ctrl_config timeout_enable_control = {
-	.ops = &timeout_ctrl_ops,
+	.ops = &packetizer_ctrl_ops,
 	.id = V4L2_CID_XFER_TIMEOUT_ENABLE,
 	.name = "Transfer timeout enable",
 	.type = V4L2_CTRL_TYPE_BOOLEAN,
@@ -754,6 +2937,196 @@ static const struct v4l2_ctrl_config timeout_enable_control = {
 	.step = 1,
 };
 
+/* Range and default depend on the packetizer clock, and are set at init */
+static const struct v4l2_ctrl_config timeout_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_TIMEOUT,
+	.name = "Transfer timeout us",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 1,
+	.step = 1,
+};
+
+static const struct v4l2_ctrl_config flush_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_FLUSH,
+	.name = "Transfer flush",
+	.type = V4L2_CTRL_TYPE_BUTTON,
+};
+
+static const struct v4l2_ctrl_config strip_filler_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_STRIP_FILLER,
+	.name = "Transfer strip filler",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = false,
+	.max = true,
+	.def = false,
+	.step = 1,
+};
+
+static const struct v4l2_ctrl_config decoder_state_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_DECODER_STATE,
+	.name = "Track decoder state",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = false,
+	.max = true,
+	.def = false,
+	.step = 1,
+};
+
+static const char * const clock_menu[] = {
+	[PSEE_DMA_CLOCK_MONOTONIC] = "Monotonic",
+	[PSEE_DMA_CLOCK_BOOTTIME] = "Boottime",
+	[PSEE_DMA_CLOCK_TAI] = "TAI",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config clock_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_CLOCK,
+	.name = "Sensor time clock",
+	.type = V4L2_CTRL_TYPE_MENU,
+	.min = PSEE_DMA_CLOCK_MONOTONIC,
+	.max = PSEE_DMA_CLOCK_TAI,
+	.def = PSEE_DMA_CLOCK_MONOTONIC,
+	.qmenu = clock_menu,
+};
+
+static const char * const pacing_menu[] = {
+	[PSEE_DMA_PACING_THROUGHPUT] = "Throughput",
+	[PSEE_DMA_PACING_TIMESTAMP] = "Timestamp",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config pacing_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_PACING,
+	.name = "Output pacing",
+	.type = V4L2_CTRL_TYPE_MENU,
+	.min = PSEE_DMA_PACING_THROUGHPUT,
+	.max = PSEE_DMA_PACING_TIMESTAMP,
+	.def = PSEE_DMA_PACING_THROUGHPUT,
+	.qmenu = pacing_menu,
+};
+
+/* 0 disables the queue depth events */
+static const struct v4l2_ctrl_config watermark_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_WATERMARK,
+	.name = "Queue watermark",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = VB2_MAX_FRAME,
+	.def = 0,
+	.step = 1,
+};
+
+static const struct v4l2_ctrl_config ring_periods_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_RING_PERIODS,
+	.name = "Ring periods",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = PSEE_DMA_MAX_RING_PERIODS,
+	.def = 0,
+	.step = 1,
+};
+
+static const struct v4l2_ctrl_config packets_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_PACKETS,
+	.name = "Packets per buffer",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 1,
+	.max = PSEE_DMA_MAX_PACKETS,
+	.def = 1,
+	.step = 1,
+};
+
+static const struct v4l2_ctrl_config completion_ring_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_COMPLETION_RING,
+	.name = "Completion ring",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = false,
+	.max = true,
+	.def = false,
+	.step = 1,
+};
+
+static const char * const coalescing_menu[] = {
+	"Off",
+	"On",
+	"Automatic",
+	NULL,
+};
+
+static const struct v4l2_ctrl_config coalescing_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_COALESCING,
+	.name = "Completion coalescing",
+	.type = V4L2_CTRL_TYPE_MENU,
+	.min = PSEE_DMA_COALESCE_OFF,
+	.max = PSEE_DMA_COALESCE_AUTO,
+	.def = PSEE_DMA_COALESCE_OFF,
+	.qmenu = coalescing_menu,
+};
+
+static const struct v4l2_ctrl_config coalesce_buffers_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_COALESCE_BUFFERS,
+	.name = "Coalesced buffers",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 2,
+	.max = VB2_MAX_FRAME,
+	.def = PSEE_DMA_COALESCE_DEF_BUFFERS,
+	.step = 1,
+};
+
+static const struct v4l2_ctrl_config coalesce_delay_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_COALESCE_DELAY,
+	.name = "Coalescing delay (us)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 1,
+	.max = USEC_PER_SEC,
+	.def = PSEE_DMA_COALESCE_DEF_DELAY_US,
+	.step = 1,
+};
+
+/* The maximum is set to the possible CPUs, 0 processes in the DMA callback */
+static const struct v4l2_ctrl_config completion_cpus_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_COMPLETION_CPUS,
+	.name = "Completion CPUs",
+	.type = V4L2_CTRL_TYPE_BITMASK,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config dma_coherent_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_DMA_COHERENT,
+	.name = "DMA coherent",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = false,
+	.max = true,
+	.step = 1,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY,
+};
+
+/* 0 disables adaptive packetization, the range is the one of the timeout */
+static const struct v4l2_ctrl_config latency_target_control = {
+	.ops = &packetizer_ctrl_ops,
+	.id = V4L2_CID_XFER_LATENCY_TARGET,
+	.name = "Transfer latency target us",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.def = 0,
+	.step = 1,
+};
+
 /* -----------------------------------------------------------------------------
  * Video DMA Core
  */
@@ -765,16 +3138,47 @@ int psee_dma_init(struct psee_composite_device *psee_dev, struct psee_dma *dma,
 	int ret;
 	struct device *dev = psee_dev->dev;
 	struct v4l2_ctrl_handler *ctrl_hdr;
+	struct v4l2_ctrl_config completion_cpus;
+	struct v4l2_ctrl_config coherent;
+	struct dma_slave_caps caps;
 
 	dma->psee_dev = psee_dev;
 	dma->port = port;
 	mutex_init(&dma->lock);
 	mutex_init(&dma->pipe.lock);
-	INIT_LIST_HEAD(&dma->queued_bufs);
 	spin_lock_init(&dma->queued_lock);
-
-	/* This is hard-coded for now, te be re-evaluated when supporting planar-formats */
+	/* The in-flight counters wrap around */
+	BUILD_BUG_ON_NOT_POWER_OF_2(VB2_MAX_FRAME);
+	INIT_LIST_HEAD(&dma->pace.bufs);
+	psee_dma_fanout_init(dma);
+	psee_dma_cring_init(dma);
+	psee_dma_coalesce_init(dma);
+	spin_lock_init(&dma->steer.lock);
+	INIT_LIST_HEAD(&dma->steer.bufs);
+	INIT_WORK(&dma->steer.work, psee_dma_steer_work);
+	dma->steer.cpu = -1;
+	/* Softirq context, like the DMA callbacks sharing queued_lock */
+	hrtimer_init(&dma->pace.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	dma->pace.timer.function = psee_dma_pace_timer;
+	hrtimer_init(&dma->flush.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	dma->flush.timer.function = psee_dma_flush_timer;
+
+	/* Default transfer size, may be changed with V4L2_CID_XFER_PACKET_LENGTH */
 	dma->transfer_size = DEFAULT_PACKET_LENGTH;
+	/* One packet per buffer, may be changed with V4L2_CID_XFER_PACKETS */
+	dma->packets = 1;
+
+	/*
+	 * Capture buffers are physically contiguous, unless the DMA can gather
+	 * them. Output buffers always are, their transfer is cut to the payload.
+	 */
+	dma->use_sg = type == V4L2_BUF_TYPE_VIDEO_CAPTURE &&
+		      of_property_read_bool(dev->of_node, "psee,scatter-gather");
+
+	/* A hardware-coherent DMA (e.g. dma-coherent on an HPC port) needs no sync */
+	dma->coherent = device_get_dma_attr(dev) == DEV_DMA_COHERENT;
+	if (dma->coherent)
+		dev_info(dev, "DMA is cache-coherent, buffers need no sync\n");
 
 	/* Initialize the media entity... */
 	dma->pad.flags = type == V4L2_BUF_TYPE_VIDEO_CAPTURE
@@ -820,10 +3224,18 @@ int psee_dma_init(struct psee_composite_device *psee_dev, struct psee_dma *dma,
 	dma->queue.drv_priv = dma;
 	dma->queue.buf_struct_size = sizeof(struct psee_dma_buffer);
 	dma->queue.ops = &psee_dma_queue_qops;
-	dma->queue.mem_ops = &vb2_dma_contig_memops;
-	dma->queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
-				   | V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+	dma->queue.mem_ops = dma->use_sg ? &vb2_dma_sg_memops : &vb2_dma_contig_memops;
+	/* Output timestamps come from the recording, and pace its replay */
+	if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		dma->queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+					   | V4L2_BUF_FLAG_TSTAMP_SRC_EOF;
+	else
+		dma->queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
 	dma->queue.dev = dev;
+#ifdef V4L2_MEMORY_FLAG_NON_COHERENT
+	/* Allow cacheable buffers (V4L2_MEMORY_FLAG_NON_COHERENT), and hints */
+	dma->queue.allow_cache_hints = 1;
+#endif
 	ret = vb2_queue_init(&dma->queue);
 	if (ret < 0) {
 		dev_err(dma->psee_dev->dev, "failed to initialize VB2 queue\n");
@@ -840,19 +3252,50 @@ int psee_dma_init(struct psee_composite_device *psee_dev, struct psee_dma *dma,
 		goto error;
 	}
 
-	/* Map the DMA packetizer registers */
-	dma->iomem = devm_ioremap_resource(dev, io_space);
-	if (IS_ERR(dma->iomem)) {
-		dev_err(dev, "Missing DMA packetizer iomem\n");
-		ret = PTR_ERR(dma->iomem);
+	/* Capture transfers may then be prepared once per buffer */
+	if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE && !dma_get_slave_caps(dma->dma, &caps))
+		dma->desc_reuse = caps.descriptor_reuse;
+
+	/*
+	 * Map the DMA packetizer registers. An output channel may feed the
+	 * pipeline directly, its DMA ends each transfer on its own.
+	 */
+	if (io_space || type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		dma->iomem = devm_ioremap_resource(dev, io_space);
+		if (IS_ERR(dma->iomem)) {
+			dev_err(dev, "Missing DMA packetizer iomem\n");
+			ret = PTR_ERR(dma->iomem);
+			dma->iomem = NULL;
+			goto error;
+		}
+		dma->iosize = resource_size(io_space);
+	}
+
+	/* The packetizer clock is optional, it is only needed to express the
+	 * transfer timeout as a duration
+	 */
+	dma->clk = devm_clk_get_optional(dev, NULL);
+	if (IS_ERR(dma->clk)) {
+		ret = PTR_ERR(dma->clk);
+		dma->clk = NULL;
+		if (ret != -EPROBE_DEFER)
+			dev_err(dev, "failed to get packetizer clock\n");
+		goto error;
+	}
+	ret = clk_prepare_enable(dma->clk);
+	if (ret < 0) {
+		dma->clk = NULL;
+		dev_err(dev, "failed to enable packetizer clock\n");
 		goto error;
 	}
-	dma->iosize = resource_size(io_space);
+	dma->clk_rate = clk_get_rate(dma->clk);
 
-	/* Make sure counter pattern is disabled */
-	write_reg(dma, REG_PACKETIZER_CONTROL, 0);
-	/* Set packet size to image size in bus words */
-	write_reg(dma, REG_PACKETIZER_PACKET_LENGTH, dma->transfer_size / 8);
+	if (dma->iomem) {
+		/* Make sure counter pattern is disabled */
+		write_reg(dma, REG_PACKETIZER_CONTROL, 0);
+		/* Set packet size to image size in bus words */
+		write_reg(dma, REG_PACKETIZER_PACKET_LENGTH, dma->transfer_size / 8);
+	}
 
 	/* Initialize the V4L2-ctl handler to tune the behavior */
 	dma->video.ctrl_handler =
@@ -863,16 +3306,91 @@ int psee_dma_init(struct psee_composite_device *psee_dev, struct psee_dma *dma,
 		ret = -ENOMEM;
 		goto error;
 	}
-	v4l2_ctrl_handler_init(ctrl_hdr, 3);
+	v4l2_ctrl_handler_init(ctrl_hdr, 19);
+
+	/* Register a control to set the transfer (and buffer) size */
+	dma->xfer_size = v4l2_ctrl_new_custom(ctrl_hdr, &packet_length_control, dma);
+
+	/* Report whether buffers need cache maintenance */
+	coherent = dma_coherent_control;
+	coherent.def = dma->coherent;
+	v4l2_ctrl_new_custom(ctrl_hdr, &coherent, dma);
+
+	/* An output only sends buffers, at the pace chosen by a control */
+	if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		v4l2_ctrl_new_custom(ctrl_hdr, &pacing_control, dma);
+
+	if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		/* Register a control to attach the decoder state to each buffer */
+		v4l2_ctrl_new_custom(ctrl_hdr, &decoder_state_control, dma);
+		/* and one to choose the clock the sensor time is mapped to */
+		v4l2_ctrl_new_custom(ctrl_hdr, &clock_control, dma);
+
+		/* Register a control to be told when few buffers are left to the DMA */
+		v4l2_ctrl_new_custom(ctrl_hdr, &watermark_control, dma);
+
+		/* Register a control to complete buffers in a shared memory ring */
+		v4l2_ctrl_new_custom(ctrl_hdr, &completion_ring_control, dma);
+
+		/* Register controls to deliver completed buffers in batches */
+		v4l2_ctrl_new_custom(ctrl_hdr, &coalescing_control, dma);
+		v4l2_ctrl_new_custom(ctrl_hdr, &coalesce_buffers_control, dma);
+		v4l2_ctrl_new_custom(ctrl_hdr, &coalesce_delay_control, dma);
+
+		/* and one to choose the CPUs processing the completed buffers */
+		completion_cpus = completion_cpus_control;
+		completion_cpus.max = GENMASK(min_t(unsigned int, nr_cpu_ids, 32) - 1, 0);
+		v4l2_ctrl_new_custom(ctrl_hdr, &completion_cpus, dma);
+
+		/* Register controls to capture in a cyclic ring, or to pack packets
+		 * in the buffers, with contiguous buffers
+		 */
+		if (!dma->use_sg) {
+			v4l2_ctrl_new_custom(ctrl_hdr, &ring_periods_control, dma);
+			v4l2_ctrl_new_custom(ctrl_hdr, &packets_control, dma);
+		}
+	}
 
 	/* Set the features of the V2 IP */
-	if ((read_reg(dma, REG_PACKETIZER_VERSION) & ~0xFFFF) == 0x20000) {
-		/* Set a timeout symbol that works in both EVT21 and EVT3 */
-		write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT_EVT_LSB, 0xE019E019);
-		write_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT_EVT_MSB, 0xE019E019);
+	if (dma->iomem)
+		dma->version = read_reg(dma, REG_PACKETIZER_VERSION);
+	if (PACKETIZER_VERSION_IS_V2(dma->version)) {
+		/* Set a timeout symbol until the format is known, at stream start */
+		psee_dma_setup_filler(dma, MEDIA_BUS_FMT_PSEE_EVT3);
+
+		/* Register a control to drop that symbol from the payload */
+		v4l2_ctrl_new_custom(ctrl_hdr, &strip_filler_control, dma);
 
 		/* Register a control to enable/disable timeout on transfers */
 		v4l2_ctrl_new_custom(ctrl_hdr, &timeout_enable_control, dma);
+
+		/* and one to close the current packet on demand, for captures */
+		if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+			v4l2_ctrl_new_custom(ctrl_hdr, &flush_control, dma);
+
+		/* and one to set its duration, if we know the clock it counts */
+		if (dma->clk_rate) {
+			struct v4l2_ctrl_config timeout = timeout_control;
+
+			timeout.min = max_t(u64, 1, psee_dma_cycles_to_us(dma, 1));
+			timeout.max = min_t(u64, S32_MAX,
+					    psee_dma_cycles_to_us(dma, U32_MAX));
+			/* Keep the hardware default */
+			timeout.def = clamp_t(s64, psee_dma_cycles_to_us(dma,
+					read_reg(dma, REG_PACKETIZER_TLAST_TIMEOUT)),
+					timeout.min, timeout.max);
+			dma->xfer_timeout = v4l2_ctrl_new_custom(ctrl_hdr, &timeout, dma);
+
+			/* Adaptive packetization needs to set the timeout */
+			if (dma->xfer_timeout) {
+				struct v4l2_ctrl_config target = latency_target_control;
+
+				target.max = timeout.max;
+				v4l2_ctrl_new_custom(ctrl_hdr, &target, dma);
+			}
+		} else {
+			dev_info(dev, "no packetizer clock, transfer timeout duration is fixed\n");
+		}
 	}
 
 	ret = ctrl_hdr->error;
@@ -887,6 +3405,13 @@ int psee_dma_init(struct psee_composite_device *psee_dev, struct psee_dma *dma,
 		goto error;
 	}
 
+	/* Capture buffers statistics go to a metadata node next to it */
+	if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE) {
+		ret = psee_dma_meta_init(dma);
+		if (ret < 0)
+			goto error;
+	}
+
 	return 0;
 
 error:
@@ -896,14 +3421,22 @@ error:
 
 void psee_dma_cleanup(struct psee_dma *dma)
 {
+	psee_dma_meta_cleanup(dma);
+
 	if (video_is_registered(&dma->video))
 		video_unregister_device(&dma->video);
 
 	if (dma->video.ctrl_handler)
 		v4l2_ctrl_handler_free(dma->video.ctrl_handler);
 
-	if (!IS_ERR_OR_NULL(dma->dma))
+	if (!IS_ERR_OR_NULL(dma->dma)) {
+		psee_dma_scratch_free(dma);
 		dma_release_channel(dma->dma);
+	}
+
+	psee_dma_cring_cleanup(dma);
+
+	clk_disable_unprepare(dma->clk);
 
 	media_entity_cleanup(&dma->video.entity);
 
@@ -8,37 +8,45 @@
 #ifndef PSEE_DMA_H
 #define PSEE_DMA_H
 
+#include <linux/cpumask.h>
 #include <linux/dmaengine.h>
+#include <linux/hrtimer.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
 #include <linux/spinlock.h>
+#include <linux/types.h>
 #include <linux/videodev2.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include <media/media-entity.h>
 #include <media/v4l2-dev.h>
 #include <media/v4l2-ctrls.h>
+#include <media/v4l2-fh.h>
 #include <media/videobuf2-v4l2.h>
 
+#include "psee-uapi.h"
+
+struct clk;
 struct dma_chan;
 struct psee_composite_device;
+struct v4l2_subdev;
 
 /**
  * struct psee_pipeline - Xilinx Video IP pipeline structure
  * @pipe: media pipeline
- * @lock: protects the pipeline @stream_count
+ * @lock: protects the pipeline @use_count
  * @use_count: number of DMA engines using the pipeline
- * @stream_count: number of DMA engines currently streaming
- * @num_dmas: number of DMA engines in the pipeline
- * @output: DMA engine at the output of the pipeline
+ *
+ * The subdevs of the pipeline are started and stopped branch by branch, with
+ * the DMA engine at the end of each branch (see
+ * psee_graph_pipeline_start_stop()).
  */
 struct psee_pipeline {
 	struct media_pipeline pipe;
 
 	struct mutex lock;
 	unsigned int use_count;
-	unsigned int stream_count;
-
-	unsigned int num_dmas;
-	struct psee_dma *output;
 };
 
 static inline struct psee_pipeline *to_psee_pipeline(struct media_entity *e)
@@ -46,6 +54,316 @@ static inline struct psee_pipeline *to_psee_pipeline(struct media_entity *e)
 	return container_of(e->pipe, struct psee_pipeline, pipe);
 }
 
+#define PSEE_DMA_MIN_TRANSFER_SIZE	PAGE_SIZE
+/* The AXI DMA length register is 26-bit wide at most, stay well below */
+#define PSEE_DMA_MAX_TRANSFER_SIZE	(32 << 20)
+
+/**
+ * struct psee_dma_adapt - Adaptive packetization state
+ * @target_us: latency target, 0 when adaptive packetization is disabled
+ * @min_timeout_us: smallest timeout the packetizer can count
+ * @max_length: largest packet length, the size of the buffers
+ * @timeout_us: transfer timeout currently programmed
+ * @packet_length: packet length currently programmed (in bytes)
+ * @last_ns: completion time of the previous buffer, 0 if none yet
+ *
+ * The controller only works on this structure, the caller programs the
+ * packetizer with the resulting @timeout_us and @packet_length.
+ */
+struct psee_dma_adapt {
+	u32 target_us;
+	u32 min_timeout_us;
+	u32 max_length;
+	u32 timeout_us;
+	u32 packet_length;
+	u64 last_ns;
+};
+
+#define PSEE_DMA_FIT_SAMPLES		32
+
+/**
+ * struct psee_dma_timefit - Linear fit between the sensor and the host time
+ * @sensor_us: sensor time of the samples (in us), unwrapped
+ * @host_ns: host time of the samples (in ns)
+ * @first: index of the oldest sample
+ * @count: number of samples, the fit is valid with at least one
+ * @sensor_ref_us: sensor time at the center of the samples
+ * @host_ref_ns: host time at @sensor_ref_us
+ * @drift_ppb: host clock drift relative to the sensor clock (in ppb)
+ */
+struct psee_dma_timefit {
+	u64 sensor_us[PSEE_DMA_FIT_SAMPLES];
+	u64 host_ns[PSEE_DMA_FIT_SAMPLES];
+	unsigned int first;
+	unsigned int count;
+	u64 sensor_ref_us;
+	u64 host_ref_ns;
+	s64 drift_ppb;
+};
+
+/**
+ * struct psee_dma_stats - Packet closing statistics since the stream start
+ * @full: number of buffers closed on a full packet
+ * @timeout: number of buffers closed on the transfer timeout
+ * @flush: number of buffers closed on a flush request
+ * @flush_lapsed: number of flush requests that closed no packet
+ * @flush_restore_failed: number of flushes after which the packetizer settings
+ *			  did not read back as restored
+ * @full_run: number of consecutive full buffers, up to the last one
+ * @max_full_run: longest run of consecutive full buffers
+ * @bytes: total payload of the closed buffers
+ * @dropped: number of packets dropped while no buffer was queued
+ * @dropped_bytes: number of bytes dropped while no buffer was queued
+ * @lock_taken: number of times the queue lock was taken
+ * @lock_contended: number of times it was found held
+ * @lock_hold_ns: total time it was held, only accounted with
+ *		  CONFIG_VIDEO_ADV_DEBUG
+ * @lock_max_hold_ns: longest time it was held, likewise
+ */
+struct psee_dma_stats {
+	u32 full;
+	u32 timeout;
+	u32 flush;
+	u32 flush_lapsed;
+	u32 flush_restore_failed;
+	u32 full_run;
+	u32 max_full_run;
+	u64 bytes;
+	u32 dropped;
+	u64 dropped_bytes;
+	u32 lock_taken;
+	u32 lock_contended;
+	u64 lock_hold_ns;
+	u64 lock_max_hold_ns;
+};
+
+/**
+ * struct psee_dma_inflight - Buffers given to the DMA engine, in transfer order
+ * @bufs: the buffers, indexed by the counters modulo VB2_MAX_FRAME
+ * @head: number of buffers given
+ * @tail: number of buffers completed
+ *
+ * A buffer is given to the DMA engine at most once at a time, the ring never
+ * overflows. All fields are protected by the DMA channel queued_lock.
+ */
+struct psee_dma_inflight {
+	struct psee_dma_buffer *bufs[VB2_MAX_FRAME];
+	u32 head;
+	u32 tail;
+};
+
+/**
+ * struct psee_dma_scratch - Driver buffer absorbing data when no buffer is queued
+ * @vaddr: kernel address of the buffer, NULL if not allocated
+ * @addr: DMA address of the buffer
+ * @size: size of the buffer (in byte)
+ * @attached: the buffer is used by the running stream
+ * @active: a transfer into the buffer is submitted
+ * @gap: data was dropped since the last completed capture buffer
+ *
+ * The buffer is allocated at stream start and kept while not streaming. Fields
+ * from @attached are protected by the DMA channel queued_lock.
+ */
+struct psee_dma_scratch {
+	void *vaddr;
+	dma_addr_t addr;
+	u32 size;
+	bool attached;
+	bool active;
+	bool gap;
+};
+
+/**
+ * struct psee_dma_flush - On-demand closing of the current packet
+ * @timer: closes the flush window if no packet was closed in it
+ * @enabled: the stream runs, flushes may be requested
+ * @pending: the flush window is open, with a single cycle timeout programmed
+ * @control: packetizer control register to restore
+ * @timeout: packetizer timeout register to restore
+ *
+ * All fields but @timer are protected by the DMA channel queued_lock.
+ */
+struct psee_dma_flush {
+	struct hrtimer timer;
+	bool enabled;
+	bool pending;
+	u32 control;
+	u32 timeout;
+};
+
+/**
+ * struct psee_dma_pace - Pacing of the output buffers on their timestamps
+ * @timer: timer submitting the buffers when they are due
+ * @bufs: buffers waiting to be submitted
+ * @started: @origin_ns and @origin_ts are set
+ * @origin_ns: CLOCK_MONOTONIC time the first buffer was due (in ns)
+ * @origin_ts: timestamp of the first buffer (in ns)
+ *
+ * All fields but @timer are protected by the DMA channel queued_lock.
+ */
+struct psee_dma_pace {
+	struct hrtimer timer;
+	struct list_head bufs;
+	bool started;
+	u64 origin_ns;
+	u64 origin_ts;
+};
+
+/**
+ * struct psee_dma_meta_node - Metadata capture node paired with a DMA channel
+ * @video: V4L2 video device of the metadata node
+ * @lock: protects the @queue field
+ * @queue: vb2 buffers queue
+ * @queued_bufs: list of queued buffers
+ * @queued_lock: protects @queued_bufs and @dropped
+ * @dropped: number of records dropped for lack of a queued buffer
+ */
+struct psee_dma_meta_node {
+	struct video_device video;
+	struct mutex lock;
+	struct vb2_queue queue;
+	struct list_head queued_bufs;
+	spinlock_t queued_lock;
+	u32 dropped;
+};
+
+/**
+ * struct psee_dma_fanout - Readers of the capture stream beside the queue owner
+ * @lock: protects all fields, and the readers count of the buffers
+ * @readers: list of the attached readers
+ * @parked: buffers queued by the owner while readers still held them
+ * @streaming: buffers are delivered to the readers
+ */
+struct psee_dma_fanout {
+	spinlock_t lock;
+	struct list_head readers;
+	struct list_head parked;
+	bool streaming;
+};
+
+/**
+ * struct psee_dma_cring_state - Kernel side of the completion ring
+ * @ring: the ring shared with the userspace, allocated on first use
+ * @enabled: capture buffers complete in the ring instead of videobuf2
+ * @lock: protects the kernel counters, the ring and the buffers cring flag
+ * @wait: wait queue woken on completions and on stream stop
+ * @comp_head: completions posted, the userspace copy is not trusted
+ * @sub_tail: submissions consumed, the userspace copy is not trusted
+ * @rejected: submissions of buffers not held by the userspace
+ */
+struct psee_dma_cring_state {
+	struct psee_dma_cring *ring;
+	bool enabled;
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	u32 comp_head;
+	u32 sub_tail;
+	u32 rejected;
+};
+
+#define PSEE_DMA_COALESCE_DEF_BUFFERS	8
+#define PSEE_DMA_COALESCE_DEF_DELAY_US	1000
+
+/**
+ * struct psee_dma_coalesce - Completion coalescing state
+ * @lock: protects all fields, and the buffers failed flag
+ * @mode: PSEE_DMA_COALESCE_* mode
+ * @buffers: buffers per batch
+ * @delay_us: longest time a completed buffer waits for its batch (in us)
+ * @bufs: completed buffers waiting for their batch
+ * @pending: number of buffers in @bufs
+ * @timer: delivers the batch once its first buffer waited @delay_us
+ * @last_ns: completion time of the previous buffer
+ * @interval_ns: average interval between buffer completions
+ * @batching: the automatic mode makes batches
+ * @batches: number of batches delivered since the stream start
+ * @batched: number of buffers delivered in these batches
+ */
+struct psee_dma_coalesce {
+	spinlock_t lock;
+	u32 mode;
+	u32 buffers;
+	u32 delay_us;
+	struct list_head bufs;
+	unsigned int pending;
+	struct hrtimer timer;
+	u64 last_ns;
+	u64 interval_ns;
+	bool batching;
+	u32 batches;
+	u64 batched;
+};
+
+/**
+ * struct psee_dma_steer - Completion processing on chosen CPUs
+ * @lock: protects all fields
+ * @cpus: CPUs processing the completions, empty to process them in the DMA
+ *	  callback
+ * @cpu: CPU the work was last queued on
+ * @bufs: completed buffers waiting for their processing
+ * @pending: number of buffers completed and not processed yet
+ * @work: processes the buffers of @bufs, in completion order
+ */
+struct psee_dma_steer {
+	spinlock_t lock;
+	cpumask_t cpus;
+	int cpu;
+	struct list_head bufs;
+	unsigned int pending;
+	struct work_struct work;
+};
+
+/**
+ * struct psee_dma_done - Completion of a capture buffer, until it is processed
+ * @payload: bytes transferred in the buffer
+ * @latency_us: time from the start of the transfer to its completion
+ * @depth: number of buffers still queued to the DMA at the completion
+ * @failed: the transfer failed
+ */
+struct psee_dma_done {
+	u32 payload;
+	u32 latency_us;
+	u32 depth;
+	bool failed;
+};
+
+/**
+ * struct psee_dma_reader - Fan-out reader of the capture stream
+ * @list: entry in the fan-out readers list
+ * @attached: the reader is in the readers list
+ * @policy: PSEE_DMA_FANOUT_* policy of the reader
+ * @wait: wait queue woken on new buffers, on stream stop and on detach
+ * @pending: ring of the buffers delivered and not dequeued yet
+ * @first: index of the oldest entry of @pending
+ * @count: number of entries in @pending
+ * @held: buffers dequeued by the reader and not released yet
+ *
+ * All fields are protected by the fan-out lock. A buffer is in @pending or in
+ * @held at most once, until it goes through the DMA again.
+ */
+struct psee_dma_reader {
+	struct list_head list;
+	bool attached;
+	u32 policy;
+	wait_queue_head_t wait;
+	struct psee_dma_fanout_buffer pending[VB2_MAX_FRAME];
+	unsigned int first;
+	unsigned int count;
+	DECLARE_BITMAP(held, VB2_MAX_FRAME);
+};
+
+/**
+ * struct psee_dma_fh - File handle of a DMA channel video node
+ * @fh: V4L2 file handle, must be first
+ * @reader: fan-out reader state of the file handle
+ */
+struct psee_dma_fh {
+	struct v4l2_fh fh;
+	struct psee_dma_reader reader;
+};
+
+#define to_psee_dma_fh(vfh)	container_of(vfh, struct psee_dma_fh, fh)
+
 /**
  * struct psee_dma - Video DMA interface to PS Host
  * @list: list entry in a composite device dmas list
@@ -56,13 +374,60 @@ static inline struct psee_pipeline *to_psee_pipeline(struct media_entity *e)
  * @port: composite device DT node port number for the DMA channel
  * @lock: protects the @queue field
  * @queue: vb2 buffers queue
+ * @use_sg: buffers are scatter-gather tables instead of contiguous memory
+ * @coherent: the DMA is cache-coherent, buffers need no cache maintenance
  * @sequence: V4L2 buffers sequence number
  * @transfer_size: Size of the DMA buffers, =maximum transfer size
- * @queued_bufs: list of queued buffers
- * @queued_lock: protects the buf_queued list
+ * @xfer_size: control setting @transfer_size
+ * @xfer_timeout: control setting the transfer timeout, if supported
+ * @adapt: adaptive packetization state, protected by @queued_lock
+ * @stats: packet closing statistics, protected by @queued_lock
+ * @flush: on-demand packet flush state
+ * @strip_filler: drop the timeout filler from the end of the payload
+ * @filler: timeout filler symbols, for the LSB and MSB halves of bus words
+ * @code: media bus code of the streamed format, set at stream start
+ * @track_decoder: attach the decoder state to the buffers
+ * @decoder: decoder state at the end of the last completed buffer
+ * @sensor_us: last sensor time seen (in us), unwrapped
+ * @sensor_valid: @sensor_us holds a time seen since the stream start
+ * @clock: PSEE_DMA_CLOCK_* clock the sensor time is mapped to
+ * @timefit: fit between the sensor time and @clock
+ * @meta: metadata node carrying the statistics of the capture buffers
+ * @csi2: CSI-2 receiver upstream, to sample its counters, set while streaming
+ * @active_ns: time the transfer of the queue head started, protected by
+ *	       @queued_lock
+ * @scratch: buffer absorbing the data while no capture buffer is queued
+ * @watermark: queue depth under which the queue is low, 0 to disable the
+ *	       events, protected by @queued_lock
+ * @queue_low: the queue depth is under @watermark, protected by @queued_lock
+ * @pacing: PSEE_DMA_PACING_* pacing of the output buffers
+ * @pace: output buffers pacing state
+ * @packets: number of packets per capture buffer, 1 if not packed
+ * @fanout: readers of the capture stream beside the queue owner
+ * @cring: completion ring shared with the userspace
+ * @coalesce: completion coalescing state
+ * @steer: completion processing CPUs state
+ * @ring_periods: number of periods in the capture ring, 0 if not in ring mode
+ * @ring_status: status page of the capture ring, in the ring buffer
+ * @ring_written: bytes written in the ring since the stream start
+ * @ring_seq: update counter of @ring_status
+ * @ring_overruns: number of periods written over unread data
+ * @inflight: buffers queued to the DMA engine
+ * @queued_lock: serializes the submissions, so that @inflight follows the
+ *		 order of the transfers
+ * @unissued: buffers at the tail of @inflight not issued to the DMA engine
+ *	      yet, protected by @queued_lock
+ * @stopping: the stream is stopping, buffers go back to videobuf2 instead of
+ *	      the DMA engine, protected by @queued_lock
+ * @desc_reuse: the DMA engine can resubmit the transfers of the capture
+ *		buffers
  * @dma: DMA engine channel
- * @iomem: Mapping of the IP registers in the kernel space
+ * @iomem: Mapping of the IP registers in the kernel space, NULL on an output
+ *	   channel with no packetizer
  * @iosize: size of the mapped register bank (in byte)
+ * @clk: packetizer clock, optional
+ * @clk_rate: packetizer clock rate (in Hz), 0 if unknown
+ * @version: packetizer IP version
  */
 struct psee_dma {
 	struct list_head list;
@@ -76,21 +441,152 @@ struct psee_dma {
 	struct mutex lock;
 
 	struct vb2_queue queue;
+	bool use_sg;
+	bool coherent;
 	unsigned int sequence;
 	u32 transfer_size;
+	struct v4l2_ctrl *xfer_size;
+	struct v4l2_ctrl *xfer_timeout;
+	struct psee_dma_adapt adapt;
+	struct psee_dma_stats stats;
+	struct psee_dma_flush flush;
+	bool strip_filler;
+	u32 filler[2];
+	u32 code;
+	bool track_decoder;
+	struct psee_dma_decoder_state decoder;
+	u64 sensor_us;
+	bool sensor_valid;
+	u32 clock;
+	struct psee_dma_timefit timefit;
+	struct psee_dma_meta_node meta;
+	struct v4l2_subdev *csi2;
+	u64 active_ns;
+	struct psee_dma_scratch scratch;
+	u32 watermark;
+	bool queue_low;
+	u32 pacing;
+	struct psee_dma_pace pace;
+	u32 packets;
+	struct psee_dma_fanout fanout;
+	struct psee_dma_cring_state cring;
+	struct psee_dma_coalesce coalesce;
+	struct psee_dma_steer steer;
 
-	struct list_head queued_bufs;
+	unsigned int ring_periods;
+	struct psee_dma_ring_status *ring_status;
+	u64 ring_written;
+	u32 ring_seq;
+	u32 ring_overruns;
+
+	struct psee_dma_inflight inflight;
 	spinlock_t queued_lock;
+	u32 unissued;
+	bool stopping;
+	bool desc_reuse;
 
 	void __iomem *iomem;
 	resource_size_t iosize;
+	struct clk *clk;
+	unsigned long clk_rate;
+	u32 version;
 	struct dma_chan *dma;
 };
 
 #define to_psee_dma(vdev)	container_of(vdev, struct psee_dma, video)
 
+/**
+ * struct psee_dma_buffer - Video DMA buffer
+ * @buf: vb2 buffer base object
+ * @queue: buffer list entry in the pacing list, in the fan-out parked buffers
+ *	   list, in the completions to process, or in the coalescing batch
+ * @dma: DMA channel that uses the buffer
+ * @length: length of the DMA transfer prepared for the buffer
+ * @cookie: cookie of the DMA transfer, valid once in the in-flight ring
+ * @info: information on the buffer, for PSEE_DMA_IOC_G_BUFINFO
+ * @readers: number of fan-out readers holding the buffer
+ * @parked: the buffer waits for the readers to release it, to go to the DMA
+ * @packets: number of packets the buffer is split in, 0 if not packed
+ * @packets_done: number of packets written in the buffer, protected by the
+ *		  DMA queued_lock
+ * @packet_error: a packet transfer failed, protected by the DMA queued_lock
+ * @table: the packets written in the buffer, protected by the DMA queued_lock
+ * @cring_user: the buffer is in the completion ring or with the userspace,
+ *		protected by the completion ring lock
+ * @no_invalidate: userspace queued the buffer with
+ *		   V4L2_BUF_FLAG_NO_CACHE_INVALIDATE
+ * @descs: transfers prepared on the first queue of a stream, resubmitted on
+ *	   the next ones
+ * @num_descs: number of transfers in @descs, 0 if they are to be prepared
+ * @failed: the transfer failed, while the buffer waits for its batch
+ * @done: completion of the buffer, while it waits for its processing
+ */
+struct psee_dma_buffer {
+	struct vb2_v4l2_buffer buf;
+	struct list_head queue;
+	struct psee_dma *dma;
+	u32 length;
+	dma_cookie_t cookie;
+	struct psee_dma_buffer_info info;
+	unsigned int readers;
+	bool parked;
+	unsigned int packets;
+	unsigned int packets_done;
+	bool packet_error;
+	struct psee_dma_packet table[PSEE_DMA_MAX_PACKETS];
+	bool cring_user;
+	bool no_invalidate;
+	struct dma_async_tx_descriptor *descs[PSEE_DMA_MAX_PACKETS];
+	unsigned int num_descs;
+	bool failed;
+	struct psee_dma_done done;
+};
+
+#define to_psee_dma_buffer(vb)	container_of(vb, struct psee_dma_buffer, buf)
+
 int psee_dma_init(struct psee_composite_device *psee_dev, struct psee_dma *dma,
 		  enum v4l2_buf_type type, unsigned int port, struct resource *io_space);
 void psee_dma_cleanup(struct psee_dma *dma);
 
+int psee_dma_meta_init(struct psee_dma *dma);
+void psee_dma_meta_cleanup(struct psee_dma *dma);
+void psee_dma_meta_complete(struct psee_dma *dma, const struct psee_dma_meta *record);
+
+void psee_dma_submit(struct psee_dma *dma, struct psee_dma_buffer *buf);
+void psee_dma_buffer_deliver(struct psee_dma *dma, struct psee_dma_buffer *buf, bool failed);
+
+void psee_dma_fanout_init(struct psee_dma *dma);
+void psee_dma_fanout_start(struct psee_dma *dma);
+void psee_dma_fanout_stop(struct psee_dma *dma);
+void psee_dma_fanout_complete(struct psee_dma *dma, struct psee_dma_buffer *buf);
+bool psee_dma_fanout_park(struct psee_dma *dma, struct psee_dma_buffer *buf);
+void psee_dma_fanout_release(struct psee_dma *dma, struct psee_dma_fh *fh);
+__poll_t psee_dma_fanout_poll(struct psee_dma *dma, struct psee_dma_fh *fh,
+			      struct file *file, poll_table *wait);
+long psee_dma_fanout_ioctl(struct psee_dma *dma, struct psee_dma_fh *fh,
+			   struct file *file, unsigned int cmd, void *arg);
+
+void psee_dma_cring_init(struct psee_dma *dma);
+void psee_dma_cring_cleanup(struct psee_dma *dma);
+int psee_dma_cring_enable(struct psee_dma *dma, bool enable);
+void psee_dma_cring_start(struct psee_dma *dma);
+void psee_dma_cring_stop(struct psee_dma *dma);
+void psee_dma_cring_complete(struct psee_dma *dma, struct psee_dma_buffer *buf, bool failed);
+int psee_dma_cring_kick(struct psee_dma *dma);
+int psee_dma_cring_mmap(struct psee_dma *dma, struct vm_area_struct *vma);
+__poll_t psee_dma_cring_poll(struct psee_dma *dma, struct v4l2_fh *fh,
+			     struct file *file, poll_table *wait);
+
+
+void psee_dma_adapt_reset(struct psee_dma_adapt *adapt, u32 target_us,
+			  u32 min_timeout_us, u32 max_length);
+bool psee_dma_adapt_update(struct psee_dma_adapt *adapt, u32 payload, u64 now_ns);
+
+void psee_dma_coalesce_init(struct psee_dma *dma);
+void psee_dma_coalesce_start(struct psee_dma *dma);
+void psee_dma_coalesce_stop(struct psee_dma *dma);
+void psee_dma_coalesce_set_mode(struct psee_dma *dma, u32 mode);
+void psee_dma_coalesce_complete(struct psee_dma *dma, struct psee_dma_buffer *buf,
+				bool failed, u64 now);
+
 #endif /* PSEE_DMA_H */
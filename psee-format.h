@@ -29,3 +29,7 @@
 #define V4L2_PIX_FMT_PSEE_EVT3 v4l2_fourcc('P', 'S', 'E', '3')
 #define MEDIA_BUS_FMT_PSEE_EVT3 0x5302
 #endif
+
+#ifndef V4L2_META_FMT_PSEE_STATS
+#define V4L2_META_FMT_PSEE_STATS v4l2_fourcc('P', 'S', 'M', 'S')
+#endif
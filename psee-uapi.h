@@ -0,0 +1,378 @@
+/* SPDX-License-Identifier: GPL-2.0-only WITH Linux-syscall-note */
+/*
+ * Prophesee Video DMA userspace API
+ *
+ * Copyright (C) Prophesee S.A.
+ */
+
+#ifndef PSEE_UAPI_H
+#define PSEE_UAPI_H
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/* V4L2 Control codes */
+#define V4L2_CID_XFER_TIMEOUT_ENABLE	(V4L2_CID_USER_BASE | 0x1001)
+#define V4L2_CID_XFER_PACKET_LENGTH	(V4L2_CID_USER_BASE | 0x1002)
+#define V4L2_CID_XFER_TIMEOUT		(V4L2_CID_USER_BASE | 0x1003)
+#define V4L2_CID_XFER_LATENCY_TARGET	(V4L2_CID_USER_BASE | 0x1004)
+#define V4L2_CID_XFER_DMA_COHERENT	(V4L2_CID_USER_BASE | 0x1005)
+#define V4L2_CID_XFER_RING_PERIODS	(V4L2_CID_USER_BASE | 0x1006)
+#define V4L2_CID_XFER_FLUSH		(V4L2_CID_USER_BASE | 0x1007)
+#define V4L2_CID_XFER_STRIP_FILLER	(V4L2_CID_USER_BASE | 0x1008)
+#define V4L2_CID_XFER_DECODER_STATE	(V4L2_CID_USER_BASE | 0x1009)
+#define V4L2_CID_XFER_CLOCK		(V4L2_CID_USER_BASE | 0x100a)
+#define V4L2_CID_XFER_WATERMARK		(V4L2_CID_USER_BASE | 0x100b)
+#define V4L2_CID_XFER_PACING		(V4L2_CID_USER_BASE | 0x100c)
+#define V4L2_CID_XFER_PACKETS		(V4L2_CID_USER_BASE | 0x100d)
+#define V4L2_CID_XFER_COMPLETION_RING	(V4L2_CID_USER_BASE | 0x100e)
+#define V4L2_CID_XFER_COALESCING	(V4L2_CID_USER_BASE | 0x100f)
+#define V4L2_CID_XFER_COALESCE_BUFFERS	(V4L2_CID_USER_BASE | 0x1010)
+#define V4L2_CID_XFER_COALESCE_DELAY	(V4L2_CID_USER_BASE | 0x1011)
+#define V4L2_CID_XFER_COMPLETION_CPUS	(V4L2_CID_USER_BASE | 0x1012)
+
+/* Values of the V4L2_CID_XFER_CLOCK menu */
+#define PSEE_DMA_CLOCK_MONOTONIC	0
+#define PSEE_DMA_CLOCK_BOOTTIME		1
+#define PSEE_DMA_CLOCK_TAI		2
+
+/* Values of the V4L2_CID_XFER_PACING menu */
+#define PSEE_DMA_PACING_THROUGHPUT	0
+#define PSEE_DMA_PACING_TIMESTAMP	1
+
+/* Values of the V4L2_CID_XFER_COALESCING menu */
+#define PSEE_DMA_COALESCE_OFF		0
+#define PSEE_DMA_COALESCE_ON		1
+#define PSEE_DMA_COALESCE_AUTO		2
+
+/*
+ * Reason why the packet of a capture buffer was closed, reported in the
+ * v4l2_buffer flags
+ */
+#define PSEE_BUF_FLAG_CLOSE_FULL	0x01000000
+#define PSEE_BUF_FLAG_CLOSE_TIMEOUT	0x02000000
+#define PSEE_BUF_FLAG_CLOSE_FLUSH	0x04000000
+#define PSEE_BUF_FLAG_CLOSE_MASK	0x07000000
+/* Data was dropped before the buffer, while no capture buffer was queued */
+#define PSEE_BUF_FLAG_GAP		0x10000000
+
+/**
+ * struct psee_dma_ring_status - Status page of the cyclic capture ring
+ * @seq: odd while the kernel updates the writer fields, incremented twice per
+ *	 update; readers retry if it is odd or changed during their read
+ * @ring_size: size of the ring (in byte), the status page follows it
+ * @period_size: size of a period (in byte), the ring is written period by period
+ * @write_offset: offset in the ring where the next period will be written
+ * @write_wrap: number of times the writer wrapped around the ring
+ * @sequence: number of periods written since the stream start
+ * @overruns: number of periods written over data not read yet
+ * @timestamp: CLOCK_MONOTONIC time of the last period completion (in ns)
+ * @read_offset: offset in the ring up to which the reader consumed data
+ * @read_wrap: number of times the reader wrapped around the ring
+ *
+ * All fields are written by the kernel, except @read_offset and @read_wrap,
+ * which are written by the userspace.
+ */
+struct psee_dma_ring_status {
+	__u32 seq;
+	__u32 ring_size;
+	__u32 period_size;
+	__u32 write_offset;
+	__u32 write_wrap;
+	__u32 sequence;
+	__u32 overruns;
+	__u32 reserved;
+	__u64 timestamp;
+	__u32 read_offset;
+	__u32 read_wrap;
+};
+
+/**
+ * struct psee_dma_progress - Progress of the buffer being filled by the DMA
+ * @index: index of the buffer at the head of the DMA queue
+ * @sequence: sequence number the buffer will get when dequeued
+ * @length: size of the transfer programmed in the buffer (in byte)
+ * @bytes: number of bytes already written in the buffer
+ * @granularity: granularity of @bytes, as an enum dma_residue_granularity
+ *		 (0: descriptor, 1: segment, 2: burst)
+ * @flags: PSEE_DMA_PROGRESS_* flags
+ * @reserved: must be zero
+ */
+struct psee_dma_progress {
+	__u32 index;
+	__u32 sequence;
+	__u32 length;
+	__u32 bytes;
+	__u32 granularity;
+	__u32 flags;
+	__u32 reserved[2];
+};
+
+/* The transfer is over, the buffer is about to be dequeued */
+#define PSEE_DMA_PROGRESS_DONE		0x00000001
+/* The transfer failed */
+#define PSEE_DMA_PROGRESS_ERROR		0x00000002
+
+/* Private events of the capture node */
+#define V4L2_EVENT_PSEE_QUEUE_LOW	(V4L2_EVENT_PRIVATE_START + 1)
+#define V4L2_EVENT_PSEE_QUEUE_RECOVERED	(V4L2_EVENT_PRIVATE_START + 2)
+
+/**
+ * struct psee_dma_event_queue - Data of the queue depth events
+ * @depth: number of buffers queued to the DMA when the event fired
+ * @watermark: V4L2_CID_XFER_WATERMARK value when the event fired
+ * @sequence: sequence number of the next buffer to complete
+ * @reserved: zero
+ */
+struct psee_dma_event_queue {
+	__u32 depth;
+	__u32 watermark;
+	__u32 sequence;
+	__u32 reserved[13];
+};
+
+/* Valid fields of struct psee_dma_decoder_state */
+#define PSEE_DECODER_TIME_HIGH		0x00000001
+#define PSEE_DECODER_TIME_LOW		0x00000002
+#define PSEE_DECODER_ADDR_Y		0x00000004
+#define PSEE_DECODER_VECT_BASE_X	0x00000008
+
+/**
+ * struct psee_dma_decoder_state - Decoder state at the start of a buffer
+ * @valid: PSEE_DECODER_* flags of the fields holding a known state
+ * @time_high: last EVT_TIME_HIGH word before the buffer
+ * @time_low: last EVT_TIME_LOW word before the buffer (EVT 3.0)
+ * @addr_y: last EVT_ADDR_Y word before the buffer (EVT 3.0)
+ * @vect_base_x: last VECT_BASE_X word before the buffer, its x moved past
+ *		 the vectors that followed it (EVT 3.0)
+ * @reserved: must be zero
+ *
+ * The fields hold the raw words of the stream, so that a decoder can be
+ * initialized by feeding them before the buffer data.
+ */
+struct psee_dma_decoder_state {
+	__u32 valid;
+	__u32 time_high;
+	__u32 time_low;
+	__u32 addr_y;
+	__u32 vect_base_x;
+	__u32 reserved[3];
+};
+
+/* Valid fields of struct psee_dma_buffer_info */
+#define PSEE_BUFINFO_SENSOR_TIME	0x00000001
+#define PSEE_BUFINFO_HOST_TIME		0x00000002
+#define PSEE_BUFINFO_CPU		0x00000004
+
+/**
+ * struct psee_dma_buffer_info - Information on a dequeued buffer
+ * @index: index of the buffer, set by the userspace
+ * @flags: PSEE_BUFINFO_* flags of the valid fields
+ * @decoder: decoder state at the start of the buffer
+ * @sensor_first_us: sensor time of the first events of the buffer (in us)
+ * @sensor_last_us: sensor time of the last events of the buffer (in us)
+ * @first_ns: @sensor_first_us mapped to the V4L2_CID_XFER_CLOCK clock (in ns)
+ * @last_ns: @sensor_last_us mapped to the V4L2_CID_XFER_CLOCK clock (in ns)
+ * @cpu: CPU that processed the buffer completion
+ * @reserved: must be zero
+ *
+ * Sensor times are unwrapped, and count from an arbitrary origin.
+ */
+struct psee_dma_buffer_info {
+	__u32 index;
+	__u32 flags;
+	struct psee_dma_decoder_state decoder;
+	__u64 sensor_first_us;
+	__u64 sensor_last_us;
+	__u64 first_ns;
+	__u64 last_ns;
+	__u32 cpu;
+	__u32 reserved[7];
+};
+
+/**
+ * struct psee_csi2_counters - Event counters of the CSI-2 receiver
+ * @frames: number of frames received
+ * @crc_errors: number of packets with a CRC error
+ * @ecc_1bit_errors: number of headers with a corrected 1-bit ECC error
+ * @ecc_2bit_errors: number of headers with an uncorrectable 2-bit ECC error
+ * @sot_errors: number of start of transmission (sync) errors
+ * @word_count_errors: number of packets with a wrong word count
+ * @line_buffer_full: number of stream line buffer overflows
+ * @reserved: must be zero
+ *
+ * Counters are reset at the stream start.
+ */
+struct psee_csi2_counters {
+	__u32 frames;
+	__u32 crc_errors;
+	__u32 ecc_1bit_errors;
+	__u32 ecc_2bit_errors;
+	__u32 sot_errors;
+	__u32 word_count_errors;
+	__u32 line_buffer_full;
+	__u32 reserved;
+};
+
+/**
+ * struct psee_dma_meta - Statistics of a capture buffer, on the metadata node
+ * @sequence: sequence number of the capture buffer
+ * @index: index of the capture buffer
+ * @bytesused: payload of the capture buffer
+ * @flags: PSEE_BUF_FLAG_CLOSE_* and PSEE_BUF_FLAG_GAP flags of the capture
+ *	   buffer
+ * @timestamp: completion time of the capture buffer (CLOCK_MONOTONIC, in ns)
+ * @latency_us: time from the start of the transfer into the buffer to its
+ *		completion, the latency of its first events
+ * @queue_depth: number of capture buffers still queued for the DMA
+ * @info_flags: PSEE_BUFINFO_* flags of the valid sensor times and CPU
+ * @cpu: CPU that processed the capture buffer completion
+ * @sensor_first_us: sensor time of the first events of the buffer (in us)
+ * @sensor_last_us: sensor time of the last events of the buffer (in us)
+ * @csi2: CSI-2 receiver counters at the buffer completion
+ * @reserved: must be zero
+ */
+struct psee_dma_meta {
+	__u32 sequence;
+	__u32 index;
+	__u32 bytesused;
+	__u32 flags;
+	__u64 timestamp;
+	__u32 latency_us;
+	__u32 queue_depth;
+	__u32 info_flags;
+	__u32 cpu;
+	__u64 sensor_first_us;
+	__u64 sensor_last_us;
+	struct psee_csi2_counters csi2;
+	__u32 reserved[4];
+};
+
+/* Policies of the fan-out readers, when they lag behind the stream */
+#define PSEE_DMA_FANOUT_BLOCK		0
+#define PSEE_DMA_FANOUT_SKIP		1
+
+/**
+ * struct psee_dma_fanout_attach - Attachment of a fan-out reader
+ * @policy: PSEE_DMA_FANOUT_* policy of the reader
+ * @reserved: must be zero
+ */
+struct psee_dma_fanout_attach {
+	__u32 policy;
+	__u32 reserved[3];
+};
+
+/**
+ * struct psee_dma_fanout_buffer - Buffer dequeued by a fan-out reader
+ * @index: index of the buffer, the only field read on release
+ * @sequence: sequence number of the buffer
+ * @bytesused: payload of the buffer
+ * @flags: PSEE_BUF_FLAG_CLOSE_* and PSEE_BUF_FLAG_GAP flags of the buffer
+ * @timestamp: timestamp of the buffer, as given to the queue owner, in ns
+ * @skipped: number of buffers skipped by the reader before this one
+ * @reserved: zero
+ */
+struct psee_dma_fanout_buffer {
+	__u32 index;
+	__u32 sequence;
+	__u32 bytesused;
+	__u32 flags;
+	__u64 timestamp;
+	__u32 skipped;
+	__u32 reserved[3];
+};
+
+/* Maximum number of packets in a packed capture buffer */
+#define PSEE_DMA_MAX_PACKETS		32
+
+/**
+ * struct psee_dma_packet - Packet written in a packed capture buffer
+ * @offset: offset of the packet in the buffer
+ * @length: length of the packet
+ * @timestamp: completion time of the packet (CLOCK_MONOTONIC, in ns)
+ */
+struct psee_dma_packet {
+	__u32 offset;
+	__u32 length;
+	__u64 timestamp;
+};
+
+/**
+ * struct psee_dma_packets - Packets written in a packed capture buffer
+ * @index: index of the buffer, set by the userspace
+ * @count: number of packets written in the buffer so far
+ * @reserved: must be zero
+ * @packets: the written packets, in order
+ */
+struct psee_dma_packets {
+	__u32 index;
+	__u32 count;
+	__u32 reserved[2];
+	struct psee_dma_packet packets[PSEE_DMA_MAX_PACKETS];
+};
+
+/* Number of entries of each direction of the completion ring */
+#define PSEE_DMA_CRING_ENTRIES		64
+/* mmap() offset of the completion ring, beyond the ones of the buffers */
+#define PSEE_DMA_CRING_OFFSET		0x40000000
+
+/**
+ * struct psee_dma_cring_entry - Buffer completed in the completion ring
+ * @index: index of the buffer
+ * @sequence: sequence number of the buffer
+ * @bytesused: payload of the buffer
+ * @flags: PSEE_BUF_FLAG_CLOSE_*, PSEE_BUF_FLAG_GAP and V4L2_BUF_FLAG_ERROR
+ *	   flags of the buffer
+ * @timestamp: timestamp of the buffer, in ns
+ */
+struct psee_dma_cring_entry {
+	__u32 index;
+	__u32 sequence;
+	__u32 bytesused;
+	__u32 flags;
+	__u64 timestamp;
+};
+
+/**
+ * struct psee_dma_cring - Completion ring shared with the userspace
+ * @comp_head: completions posted, written by the kernel
+ * @sub_tail: submissions consumed, written by the kernel
+ * @rejected: submissions of buffers not held by the userspace, written by the
+ *	      kernel
+ * @reserved0: zero
+ * @comp_tail: completions consumed, written by the userspace
+ * @sub_head: submissions posted, written by the userspace
+ * @reserved1: zero
+ * @comp: completed buffers, at their counter modulo PSEE_DMA_CRING_ENTRIES
+ * @sub: indexes of the buffers given back, at their counter modulo
+ *	 PSEE_DMA_CRING_ENTRIES
+ *
+ * Counters run freely. Each side publishes its entries before moving its
+ * counter, and reads the counter before the entries.
+ */
+struct psee_dma_cring {
+	__u32 comp_head;
+	__u32 sub_tail;
+	__u32 rejected;
+	__u32 reserved0[13];
+	__u32 comp_tail;
+	__u32 sub_head;
+	__u32 reserved1[14];
+	struct psee_dma_cring_entry comp[PSEE_DMA_CRING_ENTRIES];
+	__u32 sub[PSEE_DMA_CRING_ENTRIES];
+};
+
+/* Private ioctls */
+#define PSEE_DMA_IOC_G_PROGRESS		_IOR('V', BASE_VIDIOC_PRIVATE + 0, struct psee_dma_progress)
+#define PSEE_DMA_IOC_G_BUFINFO		_IOWR('V', BASE_VIDIOC_PRIVATE + 1, struct psee_dma_buffer_info)
+#define PSEE_DMA_IOC_FANOUT_ATTACH	_IOW('V', BASE_VIDIOC_PRIVATE + 2, struct psee_dma_fanout_attach)
+#define PSEE_DMA_IOC_FANOUT_DETACH	_IO('V', BASE_VIDIOC_PRIVATE + 3)
+#define PSEE_DMA_IOC_FANOUT_DQBUF	_IOR('V', BASE_VIDIOC_PRIVATE + 4, struct psee_dma_fanout_buffer)
+#define PSEE_DMA_IOC_FANOUT_QBUF	_IOW('V', BASE_VIDIOC_PRIVATE + 5, struct psee_dma_fanout_buffer)
+#define PSEE_DMA_IOC_G_PACKETS		_IOWR('V', BASE_VIDIOC_PRIVATE + 6, struct psee_dma_packets)
+#define PSEE_DMA_IOC_CRING_KICK		_IO('V', BASE_VIDIOC_PRIVATE + 7)
+
+/* Private ioctls of the CSI-2 receiver subdev */
+#define PSEE_CSI2_IOC_G_COUNTERS	_IOR('V', BASE_VIDIOC_PRIVATE + 16, struct psee_csi2_counters)
+
+#endif /* PSEE_UAPI_H */